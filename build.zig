@@ -16,6 +16,7 @@ pub fn build(b: *std.build.Builder) void {
         "-Wall",
         "-Wextra",
         "-Werror=return-type",
+        "-ffp-contract=off",
     });
     cpp.linkLibC();
     cpp.linkLibCpp();
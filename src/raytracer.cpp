@@ -6,7 +6,28 @@
 #include <vector>
 #include <variant>
 #include <optional>
-#include <random>
+#include <tuple>
+#include <array>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <new>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(RAYTRACER_NO_SIMD) && (defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__))
+#include <immintrin.h>
+#endif
 
 struct Vec3
 {
@@ -92,6 +113,10 @@ struct Color
     return 0.299 * r + 0.587 * g + 0.114 * b;
   }
 
+  float maximum() const {
+    return std::max(r, std::max(g, b));
+  }
+
 public: // operators
   Color operator *(float s) const {
     return Color {
@@ -181,27 +206,589 @@ struct Image
   void set(size_t x, size_t y, Color color) {
     this->pixels[y * width + x] = color;
   }
+};
+
+// Memory for one value per pixel. Either anonymous memory or a window of a
+// memory mapped file: frame buffers larger than memory are then paged in
+// and out by the OS, only the rows being rendered have to stay resident.
+template<typename T>
+struct PixelArray
+{
+  T * values = nullptr;
+  size_t count = 0;
+  bool file_backed = false;
+
+  PixelArray() = default;
+
+  // `fd` -1 for anonymous memory, otherwise `offset` must be page aligned
+  PixelArray(size_t count, int fd, size_t offset) :
+    count(count),
+    file_backed(fd >= 0)
+  {
+    if(count == 0)
+      return;
+    int flags = file_backed ? MAP_SHARED : (MAP_PRIVATE | MAP_ANONYMOUS);
+    void * memory = mmap(nullptr, bytes(), PROT_READ | PROT_WRITE, flags, fd, off_t(offset));
+    if(memory != MAP_FAILED)
+      values = static_cast<T *>(memory); // both kinds start out zeroed
+  }
+
+  PixelArray(PixelArray const &) = delete;
+  PixelArray & operator=(PixelArray const &) = delete;
+
+  PixelArray(PixelArray && other) noexcept :
+    values(std::exchange(other.values, nullptr)),
+    count(std::exchange(other.count, 0)),
+    file_backed(other.file_backed)
+  {
+
+  }
+
+  PixelArray & operator=(PixelArray && other) noexcept
+  {
+    std::swap(values, other.values);
+    std::swap(count, other.count);
+    std::swap(file_backed, other.file_backed);
+    return *this;
+  }
+
+  ~PixelArray()
+  {
+    if(values != nullptr)
+      munmap(values, bytes());
+  }
+
+  size_t bytes() const { return count * sizeof(T); }
+
+  // Drops the values [begin, end) from memory. Only file backed arrays can
+  // read them back later, anonymous memory is left alone.
+  void release(size_t begin, size_t end) const
+  {
+    if(!file_backed || values == nullptr)
+      return;
+    size_t const page = size_t(sysconf(_SC_PAGESIZE));
+    uintptr_t first = (reinterpret_cast<uintptr_t>(values + begin) + page - 1) / page * page;
+    uintptr_t last = reinterpret_cast<uintptr_t>(values + end) / page * page;
+    if(first < last)
+      madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED);
+  }
+
+  T * data() { return values; }
+  T const * data() const { return values; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  T * begin() { return values; }
+  T * end() { return values + count; }
+  T const * begin() const { return values; }
+  T const * end() const { return values + count; }
+  T & operator[](size_t i) { return values[i]; }
+  T const & operator[](size_t i) const { return values[i]; }
+};
+
+// Per pixel sums of what the primary rays of the rendered samples hit, used to
+// guide the denoiser and written as arbitrary output variables. Samples that
+// miss everything add zero. resolve() gives the averages.
+struct FeatureBuffers
+{
+  size_t width, height;
+  std::vector<Color> albedo;     // diffuse albedo plus mirror reflectivity
+  std::vector<Vec3> normal;
+  std::vector<float> depth;      // distance along the primary ray
+  std::vector<uint32_t> samples; // added to the sums
+  std::vector<uint32_t> object;  // index + 1 of the object under the sample closest to the pixel center, 0 for none
+  std::vector<float> object_offset; // squared distance of that sample from the center, in pixels
+
+  FeatureBuffers(size_t width, size_t height) :
+    width(width), height(height),
+    albedo(width * height), normal(width * height), depth(width * height, 0.0f), samples(width * height, 0),
+    object(width * height, 0), object_offset(width * height, std::numeric_limits<float>::infinity())
+  {
+
+  }
+
+  // a sample `center_offset` from the pixel center whose ray hit the object `id`,
+  // which is the index + 1 as in `object`, the other values are zero for a miss
+  void add(size_t pixel, float center_offset, uint32_t id, Color sample_albedo, Vec3 sample_normal, float sample_depth)
+  {
+    samples[pixel] += 1;
+    albedo[pixel] += sample_albedo;
+    normal[pixel] = normal[pixel] + sample_normal;
+    depth[pixel] += sample_depth;
+    if(center_offset < object_offset[pixel]) {
+      object_offset[pixel] = center_offset;
+      object[pixel] = id;
+    }
+  }
+
+  FeatureBuffers resolve() const
+  {
+    FeatureBuffers result = *this;
+    for(size_t i = 0; i < samples.size(); i++)
+    {
+      float const scale = (samples[i] > 0) ? 1.0f / float(samples[i]) : 0.0f;
+      result.albedo[i] = albedo[i] * scale;
+      result.normal[i] = normal[i] * scale;
+      result.depth[i] = depth[i] * scale;
+    }
+    return result;
+  }
+};
+
+// Sum and number of samples of every pixel.
+// Passes of samples can be added over time, resolve() gives the current average.
+// With a `backing_file` the buffers live in that file instead of memory, see PixelArray.
+struct Accumulator
+{
+  size_t width, height;
+  PixelArray<Color> sum;
+  PixelArray<Color> sum_squares; // for the variance of every pixel
+  PixelArray<uint32_t> samples;
+  // The primary hits of the same samples, only kept when `features` is set.
+  // Checkpoints don't keep them, a resumed render has those of its own samples.
+  std::optional<FeatureBuffers> features;
+
+  // the byte offsets of the arrays in a backing file when they start at `offset`
+  struct Layout
+  {
+    size_t sum, sum_squares, samples, end;
+  };
+
+  // the three arrays one after the other, each starting on a page boundary
+  static Layout layout(size_t width, size_t height, size_t offset)
+  {
+    size_t const page = size_t(sysconf(_SC_PAGESIZE));
+    auto aligned = [page](size_t bytes) { return (bytes + page - 1) / page * page; };
+    size_t const colors = aligned(width * height * sizeof(Color));
+    size_t const counts = aligned(width * height * sizeof(uint32_t));
+    return Layout { offset, offset + colors, offset + 2 * colors, offset + 2 * colors + counts };
+  }
+
+  Accumulator(size_t width, size_t height, char const * backing_file = nullptr) :
+    width(width), height(height)
+  {
+    size_t const count = width * height;
+    if(backing_file == nullptr) {
+      sum = PixelArray<Color>(count, -1, 0);
+      sum_squares = PixelArray<Color>(count, -1, 0);
+      samples = PixelArray<uint32_t>(count, -1, 0);
+      return;
+    }
+
+    int fd = open(backing_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+      return;
+    if(ftruncate(fd, off_t(layout(width, height, 0).end)) == 0)
+      map(fd, 0);
+    close(fd); // the mappings keep the file open
+  }
+
+  // The arrays in `fd` as laid out by layout(width, height, offset).
+  // `offset` must be page aligned and the file already large enough.
+  Accumulator(size_t width, size_t height, int fd, size_t offset) :
+    width(width), height(height)
+  {
+    map(fd, offset);
+  }
+
+  bool ok() const {
+    return sum.data() != nullptr && sum_squares.data() != nullptr && samples.data() != nullptr;
+  }
+
+  void map(int fd, size_t offset)
+  {
+    Layout const at = layout(width, height, offset);
+    sum = PixelArray<Color>(width * height, fd, at.sum);
+    sum_squares = PixelArray<Color>(width * height, fd, at.sum_squares);
+    samples = PixelArray<uint32_t>(width * height, fd, at.samples);
+  }
+
+  // lets the rows [begin, end) leave memory, they are read back when needed
+  void release(size_t begin, size_t end) const
+  {
+    sum.release(begin * width, end * width);
+    sum_squares.release(begin * width, end * width);
+    samples.release(begin * width, end * width);
+  }
+
+  Image resolve() const
+  {
+    Image image { width, height };
+    resolveRows(0, height, image.pixels.data());
+    return image;
+  }
+
+  // writes the mean of every pixel in the rows [begin, end) to `pixels`
+  void resolveRows(size_t begin, size_t end, Color * pixels) const
+  {
+    for(size_t i = begin * width; i < end * width; i++) {
+      *pixels++ = (samples[i] > 0) ? sum[i] * (1.0 / float(samples[i])) : Color { 0.0 };
+    }
+  }
+
+  // the variance of every pixel's mean, per channel
+  std::vector<Color> variance() const
+  {
+    std::vector<Color> result(sum.size(), Color { 0.0 });
+    for(size_t i = 0; i < sum.size(); i++)
+    {
+      if(samples[i] < 2)
+        continue;
+      float n = float(samples[i]);
+      Color mean = sum[i] * (1.0f / n);
+      Color sample_variance = (sum_squares[i] - mean * sum[i]) * (1.0f / (n - 1.0f));
+      result[i] = Color {
+        std::max(0.0f, sample_variance.r / n),
+        std::max(0.0f, sample_variance.g / n),
+        std::max(0.0f, sample_variance.b / n),
+      };
+    }
+    return result;
+  }
+
+  // the smallest number of samples any pixel has
+  size_t minSamples() const
+  {
+    if(samples.empty())
+      return 0;
+    uint32_t result = std::numeric_limits<uint32_t>::max();
+    size_t const rows = 256; // don't page in a file backed buffer all at once
+    for(size_t y = 0; y < height; y += rows)
+    {
+      size_t const end = std::min(height, y + rows);
+      result = std::min(result, *std::min_element(samples.begin() + y * width, samples.begin() + end * width));
+      samples.release(y * width, end * width);
+    }
+    return result;
+  }
+
+  // Identifies the render a checkpoint belongs to. The sample streams are
+  // counter based, so seed, frame and the per pixel sample counts are the
+  // complete random number state.
+  struct CheckpointKey
+  {
+    uint32_t seed;
+    uint32_t frame;
+    uint64_t scene; // anything else that changes the rendered image
+  };
+
+  // Checkpoint layout, in native byte order:
+  //   header (see CheckpointHeader)
+  //   width * height * 3 floats: sum of the samples, rgb per pixel, row by row
+  //   width * height * 3 floats: sum of the squared samples
+  //   width * height uint32: number of samples per pixel
+  struct CheckpointHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t seed;
+    uint32_t frame;
+    uint32_t reserved;
+    uint64_t scene;
+    uint64_t width;
+    uint64_t height;
+  };
+
+  static constexpr char checkpoint_magic[8] = { 'R', 'T', 'C', 'H', 'E', 'C', 'K', 0 };
+  static constexpr uint32_t checkpoint_version = 2;
+
+  // Writes to a temporary file first, so a preempted write never destroys the previous checkpoint.
+  // The data is synced before the rename and the rename before returning, otherwise a crash could
+  // leave the new name pointing at a file whose contents never reached the disk.
+  bool saveCheckpoint(char const * file_name, CheckpointKey const & key) const
+  {
+    std::string temp_file = std::string(file_name) + ".tmp";
+    FILE * f = fopen(temp_file.c_str(), "wb");
+    if(f == nullptr)
+      return false;
+
+    CheckpointHeader header { };
+    memcpy(header.magic, checkpoint_magic, sizeof header.magic);
+    header.version = checkpoint_version;
+    header.seed = key.seed;
+    header.frame = key.frame;
+    header.scene = key.scene;
+    header.width = width;
+    header.height = height;
+
+    static_assert(sizeof(Color) == 3 * sizeof(float), "Color must be tightly packed");
+    bool ok = fwrite(&header, sizeof header, 1, f) == 1
+      && fwrite(sum.data(), sizeof(Color), sum.size(), f) == sum.size()
+      && fwrite(sum_squares.data(), sizeof(Color), sum_squares.size(), f) == sum_squares.size()
+      && fwrite(samples.data(), sizeof(uint32_t), samples.size(), f) == samples.size()
+      && fflush(f) == 0
+      && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+
+    if(!ok || std::rename(temp_file.c_str(), file_name) != 0) {
+      std::remove(temp_file.c_str());
+      return false;
+    }
+
+    // the rename itself is only durable once the directory is synced
+    char const * slash = strrchr(file_name, '/');
+    std::string directory = (slash == nullptr) ? std::string(".") : std::string(file_name, std::max<size_t>(1, slash - file_name));
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+      return false;
+    ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+  }
+
+  // Fails if the file is no checkpoint of a render with the same size and key.
+  bool loadCheckpoint(char const * file_name, CheckpointKey const & key)
+  {
+    FILE * f = fopen(file_name, "rb");
+    if(f == nullptr)
+      return false;
+
+    CheckpointHeader header;
+    bool ok = fread(&header, sizeof header, 1, f) == 1
+      && memcmp(header.magic, checkpoint_magic, sizeof header.magic) == 0
+      && header.version == checkpoint_version
+      && header.seed == key.seed
+      && header.frame == key.frame
+      && header.scene == key.scene
+      && header.width == width
+      && header.height == height
+      && fread(sum.data(), sizeof(Color), sum.size(), f) == sum.size()
+      && fread(sum_squares.data(), sizeof(Color), sum_squares.size(), f) == sum_squares.size()
+      && fread(samples.data(), sizeof(uint32_t), samples.size(), f) == samples.size();
+
+    fclose(f);
+    return ok;
+  }
+};
+
+// Accumulation buffers in a POSIX shared memory object, so a viewer in
+// another process can map them and show the render while it progresses,
+// without copies or file I/O. A Header at offset 0 describes the layout,
+// the arrays follow as in Accumulator::layout(). The README has the details.
+// The object is replaced by the next render with the same name and is left
+// behind at the end, so the final image can still be viewed.
+// see: https://man7.org/linux/man-pages/man7/shm_overview.7.html
+struct SharedFrameBuffer
+{
+  static constexpr uint32_t version = 1;
+
+  // in native byte order
+  struct Header
+  {
+    char magic[8];                // "RTSHARE\0"
+    uint32_t version;
+    uint32_t header_size;         // sizeof(Header)
+    uint64_t width, height;
+    uint64_t sum_offset;          // width * height rgb float triples, row by row
+    uint64_t sum_squares_offset;  // the same for the squares of the samples
+    uint64_t samples_offset;      // width * height uint32 sample counts
+    uint64_t target_samples;      // per pixel when the render is done, 0 if unknown
+    std::atomic<uint64_t> generation; // incremented whenever rows or passes are done
+    std::atomic<uint32_t> complete;   // 1 once the render has ended
+    uint32_t reserved;
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+    "the counters must work across processes");
+  static_assert(sizeof(Header) == 80, "the layout is documented in the README");
+
+  std::string name;
+  size_t width, height;
+  int fd = -1;
+  PixelArray<Header> header;
+
+  SharedFrameBuffer(char const * shm_name, size_t width, size_t height, uint64_t target_samples) :
+    name(shm_name[0] == '/' ? shm_name : std::string("/") + shm_name),
+    width(width), height(height)
+  {
+    // a new object, viewers of the previous one keep their mapping
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0)
+      return;
+
+    size_t const page = size_t(sysconf(_SC_PAGESIZE));
+    size_t const data_offset = (sizeof(Header) + page - 1) / page * page;
+    Accumulator::Layout const at = Accumulator::layout(width, height, data_offset);
+    if(ftruncate(fd, off_t(at.end)) != 0)
+      return;
+    header = PixelArray<Header>(1, fd, 0);
+    if(header.data() == nullptr)
+      return;
+
+    Header * h = new (header.data()) Header { };
+    memcpy(h->magic, "RTSHARE", 8);
+    h->version = version;
+    h->header_size = sizeof(Header);
+    h->width = width;
+    h->height = height;
+    h->sum_offset = at.sum;
+    h->sum_squares_offset = at.sum_squares;
+    h->samples_offset = at.samples;
+    h->target_samples = target_samples;
+  }
+
+  SharedFrameBuffer(SharedFrameBuffer const &) = delete;
+  SharedFrameBuffer & operator=(SharedFrameBuffer const &) = delete;
+
+  ~SharedFrameBuffer()
+  {
+    if(fd >= 0)
+      close(fd);
+  }
 
-  bool save(char const * file_name) const 
+  bool ok() const {
+    return header.data() != nullptr;
+  }
+
+  // an accumulator whose buffers are the arrays in shared memory
+  Accumulator accumulator() const {
+    return Accumulator { width, height, fd, size_t(header[0].sum_offset) };
+  }
+
+  // tells viewers that more of the image is done
+  void publish() {
+    header[0].generation.fetch_add(1, std::memory_order_release);
+  }
+
+  void finish()
+  {
+    header[0].complete.store(1, std::memory_order_release);
+    publish();
+  }
+};
+
+// Multi channel image in the OpenEXR format, without compression.
+// Channels hold either 32 bit floats or 32 bit unsigned integers.
+// see: https://openexr.com/en/latest/OpenEXRFileLayout.html
+struct ExrImage
+{
+  enum class Type : uint32_t
+  {
+    uint = 0,
+    float32 = 2,
+  };
+
+  struct Channel
+  {
+    std::string name;
+    Type type;
+    std::vector<uint32_t> bits; // one value per pixel, floats as their bit pattern
+  };
+
+  size_t width, height;
+  std::vector<Channel> channels;
+
+  void add(std::string name, std::vector<float> const & values)
+  {
+    Channel channel { std::move(name), Type::float32, std::vector<uint32_t>(values.size()) };
+    memcpy(channel.bits.data(), values.data(), values.size() * sizeof(float));
+    channels.push_back(std::move(channel));
+  }
+
+  void add(std::string name, std::vector<uint32_t> values)
+  {
+    channels.push_back(Channel { std::move(name), Type::uint, std::move(values) });
+  }
+
+  // readers expect the channels in alphabetical order, also within a scan line
+  std::vector<Channel const *> sorted() const
+  {
+    std::vector<Channel const *> result;
+    for(Channel const & channel : channels)
+      result.push_back(&channel);
+    std::sort(result.begin(), result.end(), [](Channel const * a, Channel const * b) {
+      return a->name < b->name;
+    });
+    return result;
+  }
+
+  // bytes of one scan line block, without its y and size fields
+  size_t lineSize() const {
+    return 4 * width * channels.size();
+  }
+
+  // Everything in front of the first scan line: header and offset table.
+  // Only needs the names and types of the channels, not their values.
+  std::vector<uint8_t> header() const
+  {
+    std::vector<Channel const *> const sorted = this->sorted();
+    std::vector<uint8_t> header;
+    auto u8 = [&](uint8_t v) { header.push_back(v); };
+    auto u32 = [&](uint32_t v) { for(size_t i = 0; i < 4; i++) u8(uint8_t(v >> (8 * i))); };
+    auto f32 = [&](float v) { uint32_t b; memcpy(&b, &v, 4); u32(b); };
+    auto str = [&](std::string const & s) { header.insert(header.end(), s.begin(), s.end()); u8(0); };
+    auto attribute = [&](char const * name, char const * type, size_t size) { str(name); str(type); u32(uint32_t(size)); };
+    auto box = [&](char const * name) {
+      attribute(name, "box2i", 16);
+      u32(0); u32(0); u32(uint32_t(width - 1)); u32(uint32_t(height - 1));
+    };
+
+    u32(20000630); // magic
+    u32(2);        // version 2, single part scan lines
+
+    size_t list_size = 1;
+    for(Channel const * channel : sorted)
+      list_size += channel->name.size() + 1 + 16;
+    attribute("channels", "chlist", list_size);
+    for(Channel const * channel : sorted) {
+      str(channel->name);
+      u32(uint32_t(channel->type));
+      u32(0); // linear flag and reserved bytes
+      u32(1); // x sampling
+      u32(1); // y sampling
+    }
+    u8(0);
+
+    attribute("compression", "compression", 1);
+    u8(0); // none
+    box("dataWindow");
+    box("displayWindow");
+    attribute("lineOrder", "lineOrder", 1);
+    u8(0); // increasing y
+    attribute("pixelAspectRatio", "float", 4);
+    f32(1.0f);
+    attribute("screenWindowCenter", "v2f", 8);
+    f32(0.0f); f32(0.0f);
+    attribute("screenWindowWidth", "float", 4);
+    f32(1.0f);
+    u8(0); // end of header
+
+    // offset table, one scan line per block
+    uint64_t offset = header.size() + 8 * height;
+    for(size_t y = 0; y < height; y++) {
+      u32(uint32_t(offset));
+      u32(uint32_t(offset >> 32));
+      offset += 8 + lineSize();
+    }
+    return header;
+  }
+
+  bool save(char const * file_name) const
   {
     FILE * f = fopen(file_name, "wb");
     if(f == nullptr)
       return false;
-    
-    fprintf(f, "P6 %lu %lu 255\n", width, height);
+    std::vector<uint8_t> const start = header();
+    bool ok = fwrite(start.data(), 1, start.size(), f) == start.size();
 
-    for(Color c : pixels)
+    std::vector<Channel const *> const sorted = this->sorted();
+    size_t const line_size = lineSize();
+
+    std::vector<uint8_t> line(8 + line_size);
+    for(size_t y = 0; ok && y < height; y++)
     {
-      uint8_t binary[3] = {
-        uint8_t(std::max(0.0, std::min(255.0, 255.0 * c.r))),
-        uint8_t(std::max(0.0, std::min(255.0, 255.0 * c.g))),
-        uint8_t(std::max(0.0, std::min(255.0, 255.0 * c.b))),
-      };
-      fwrite(binary, 3, 1, f);
+      uint8_t * out = line.data();
+      auto put = [&](uint32_t v) { for(size_t i = 0; i < 4; i++) *out++ = uint8_t(v >> (8 * i)); };
+      put(uint32_t(y));
+      put(uint32_t(line_size));
+      for(Channel const * channel : sorted) {
+        for(size_t x = 0; x < width; x++)
+          put(channel->bits[y * width + x]);
+      }
+      ok = fwrite(line.data(), 1, line.size(), f) == line.size();
     }
 
-    fclose(f);
-    return true;
+    ok = (fclose(f) == 0) && ok;
+    return ok;
   }
 };
 
@@ -239,183 +826,4280 @@ struct PointLight
 };
 
 
-struct Intersection
+// Axis aligned bounding box
+struct Aabb
 {
-  float distance;
-  Vec3 position;
-  Vec3 normal;
-  Material const * material;
-};
+  Vec3 lower, upper;
 
-struct Plane
-{
-  Material * const material;
-  Vec3 origin;
-  Vec3 normal;
-  
-  // https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-plane-and-ray-disk-intersection
-  std::optional<Intersection> intersect(Vec3 ray_origin, Vec3 ray_direction) const 
+  static Aabb empty()
   {
-    // assuming vectors are all normalized
-    float denom = -normal.dot(ray_direction); 
-    if (denom > 1e-6) { 
-        Vec3 p0l0 = origin - ray_origin; 
-        float t = -p0l0.dot(normal) / denom; 
-        if(t >= 0) {
-          return Intersection {
-            t,
-            ray_origin + ray_direction * t,
-            normal,
-            material,
-          };
-        }
-    } 
-    return std::nullopt;
+    float const inf = std::numeric_limits<float>::infinity();
+    return Aabb { Vec3(inf, inf, inf), Vec3(-inf, -inf, -inf) };
   }
-};
 
-struct Sphere 
-{
-  Material * const material;
-  Vec3 center;
-  float radius;
+  void extend(Vec3 point)
+  {
+    lower = Vec3 { std::min(lower.x, point.x), std::min(lower.y, point.y), std::min(lower.z, point.z) };
+    upper = Vec3 { std::max(upper.x, point.x), std::max(upper.y, point.y), std::max(upper.z, point.z) };
+  }
 
-  // https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
-  std::optional<Intersection> intersect(Vec3 ray_origin, Vec3 ray_direction) const 
+  void extend(Aabb const & other)
   {
-    float radius2 = radius * radius;
-    
-    Vec3 L = center - ray_origin; 
-    float tca = L.dot(ray_direction); 
-    float d2 = L.dot(L) - tca * tca;
-    if (d2 > radius2) {
-      return std::nullopt; 
-    }
-    float thc = sqrt(radius2 - d2); 
-    float t0 = tca - thc; 
-    float t1 = tca + thc; 
+    extend(other.lower);
+    extend(other.upper);
+  }
 
-    if (t0 > t1) {
-      std::swap(t0, t1); 
-    }
+  Vec3 center() const {
+    return (lower + upper) * 0.5;
+  }
 
-    if (t0 < 0) { 
-        t0 = t1; // if t0 is negative, let's use t1 instead 
-        if (t0 < 0) {
-          return std::nullopt; // both t0 and t1 are negative 
-        }
-    } 
+  Vec3 extents() const {
+    return upper - lower;
+  }
 
-    return Intersection {
-      t0,
-      ray_origin + ray_direction * t0,
-      (ray_origin + ray_direction * t0 - center).normalize(),
-      material,
-    }; 
+  float surfaceArea() const {
+    Vec3 e = extents();
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
   }
-};
 
-using Object = std::variant<Plane, Sphere>;
+  // https://tavianator.com/2011/ray_box.html
+  // `inv_direction` is the component wise reciprocal of the ray direction.
+  bool intersect(Vec3 ray_origin, Vec3 inv_direction, float max_distance) const
+  {
+    float tx0 = (lower.x - ray_origin.x) * inv_direction.x;
+    float tx1 = (upper.x - ray_origin.x) * inv_direction.x;
+    float ty0 = (lower.y - ray_origin.y) * inv_direction.y;
+    float ty1 = (upper.y - ray_origin.y) * inv_direction.y;
+    float tz0 = (lower.z - ray_origin.z) * inv_direction.z;
+    float tz1 = (upper.z - ray_origin.z) * inv_direction.z;
 
+    float t_near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+    float t_far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), max_distance));
 
-struct Scene
+    return t_near <= t_far;
+  }
+};
+
+// Counter based random number generator (Philox4x32-10).
+// The output is a pure function of a 128 bit counter and a 64 bit key, so every
+// random number can be computed independently without any shared state.
+// see: https://www.thesalmons.org/john/random123/papers/random123sc11.pdf
+struct Philox
 {
-  std::vector<Object> objects;
-  std::vector<PointLight> lights;
+  using Counter = std::array<uint32_t, 4>;
+  using Key = std::array<uint32_t, 2>;
 
-  std::optional<Intersection> intersect(Vec3 ray_origin, Vec3 ray_direction) const 
+  static Counter generate(Counter ctr, Key key)
   {
-    Intersection final_hit;
-    final_hit.distance = std::numeric_limits<float>::max();
-
-    for(Object const & obj : objects)
+    for(size_t round = 0; round < 10; round++)
     {
-      auto hit = std::visit([=](auto & obj) -> std::optional<Intersection> {
-        return obj.intersect(ray_origin, ray_direction);
-      }, obj);
-      if(hit != std::nullopt) {
-        if(hit->distance < final_hit.distance) {
-          final_hit = *hit;
-        }
-      }
-    }
-
-    if(final_hit.distance != std::numeric_limits<float>::max()) {
-      return final_hit;
-    } else {
-      return std::nullopt;
+      uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+      uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+      ctr = Counter {
+        uint32_t(p1 >> 32) ^ ctr[1] ^ key[0],
+        uint32_t(p1),
+        uint32_t(p0 >> 32) ^ ctr[3] ^ key[1],
+        uint32_t(p0),
+      };
+      key[0] += 0x9E3779B9;
+      key[1] += 0xBB67AE85;
     }
+    return ctr;
   }
+};
 
-  static constexpr size_t max_recursion = 10;
-  std::optional<Color> trace(Vec3 ray_origin, Vec3 ray_direction, size_t recursion = max_recursion) const 
-  {
-      auto intersection = intersect(ray_origin, ray_direction);
-      if(intersection == std::nullopt)
-        return std::nullopt;
-      
-      Material const * surface_mtl = intersection->material;
-
-      Color surface_albedo = surface_mtl->albedo;
-      Color surface_reflection { 0.0 };
-
-      if(surface_albedo.brightness() > 0.0)
-      {
-        Color lighting { 0.1 }; // fake some basic ambient lighting
-        for(auto const & light : lights)
-        {
-          Vec3 light_delta = (intersection->position - light.position);
-          Vec3 light_dir = light_delta.normalize();
+// The random numbers used by a single sample of a single pixel.
+// Keyed by frame and seed, counted by pixel, sample and dimension, so a sample
+// yields the same numbers no matter which thread or machine computes it.
+struct SampleRng
+{
+  Philox::Key key;
+  Philox::Counter counter;
+  Philox::Counter block;
+  size_t used = 4;
 
-          float distance_to_light = light_delta.length();
-          if(auto hit = intersect(light.position, light_dir))
-          {
-            if(hit->distance < (distance_to_light - 1e-3)) { // needs tiny delta due to imprecision
-              // ray to light is obstructed
-              continue;
-            }
-          }
+  // leading dimensions provided by a low discrepancy sampler
+  static constexpr size_t max_stratified = 4;
+  std::array<float, max_stratified> stratified { };
+  size_t stratified_count = 0;
+  size_t dimension = 0;
 
-          // How strong is the light after a certain distance
-          float attenuation = light.power / distance_to_light;
-        
-          // How much is the light reflected by the surface
-          float brdf = std::max(0.0f, -light_dir.dot(intersection->normal));
+  // Samplers whose dimensions are expensive leave `stratified` empty and set
+  // `stratify`, which computes a dimension from `sampler`, `index` and `seed`
+  // when it is used. Most paths never use more than the pixel position.
+  float (*stratify)(SampleRng const & rng, size_t dimension) = nullptr;
+  void const * sampler = nullptr;
+  uint32_t index = 0;
+  uint32_t seed = 0;
 
-          lighting += light.color * attenuation * brdf;
-        }
-        surface_albedo *= lighting;
-      }
+  SampleRng() : SampleRng(0, 0, 0, 0) { }
 
-      // these things might have recursion, guard them
-      if(recursion > 0)
-      {
-        if(surface_mtl->reflectivity > 0.0)
-        {
-          Vec3 refl_dir = ray_direction.reflect(intersection->normal);
-          Vec3 refl_origin = intersection->position + refl_dir * 1e-4;
+  SampleRng(uint32_t seed, uint32_t frame, uint64_t pixel, uint32_t sample) :
+    key { frame, seed },
+    counter { uint32_t(pixel), uint32_t(pixel >> 32), sample, 0 },
+    block { }
+  {
 
-          if(auto hit = trace(refl_origin, refl_dir, recursion - 1))
-          {
-            surface_reflection = *hit;
-          }
-        }
-      }
+  }
 
-      return surface_albedo + surface_reflection;
+  // returns a uniformly distributed number in [0, 1)
+  float next()
+  {
+    if(dimension < stratified_count)
+      return (stratify != nullptr) ? stratify(*this, dimension++) : stratified[dimension++];
+    if(used == block.size()) {
+      block = Philox::generate(counter, key);
+      counter[3] += 1;
+      used = 0;
+    }
+    // use the upper 24 bits so the result is exactly representable
+    return float(block[used++] >> 8) * 0x1.0p-24f;
   }
+};
 
+// Low discrepancy samplers provide the leading dimensions of a sample (pixel
+// position first), the remaining dimensions come from the random stream.
+// All of them are pure functions of pixel and sample index, like SampleRng.
+// `pixelSeeds` is called once per pixel, `start` once per sample with its result.
+
+// Independent uniform random numbers for every dimension
+struct UniformSampler
+{
+  Philox::Counter pixelSeeds(uint64_t) const { return { }; }
+  void start(SampleRng &, size_t, size_t, Philox::Counter const &, uint32_t) const { }
 };
 
-int main()
+// Owen scrambled and shuffled Sobol sequence, decorrelated per pixel.
+// see: https://jcgt.org/published/0009/04/01/paper.pdf
+struct SobolSampler
 {
-  Image target { 512, 512 };
-  target.clear(Color(0,0,0));
+  static constexpr size_t dimensions = SampleRng::max_stratified;
 
-  Camera camera;
-  camera.lookAt(
-    Vec3(0,0,-10), 
-    Vec3(0,0,0), 
+  std::array<std::array<uint32_t, 32>, dimensions> directions;
+  Philox::Key key;
+
+  SobolSampler(uint32_t seed, uint32_t frame) :
+    directions { },
+    key { frame ^ 0x50B01u, ~seed }
+  {
+    // primitive polynomials (degree, coefficients) and initial numbers from
+    // https://web.maths.unsw.edu.au/~fkuo/sobol/new-joe-kuo-6.21201
+    struct Polynomial { uint32_t degree, coefficients; uint32_t initial[3]; };
+    static constexpr Polynomial polynomials[dimensions - 1] = {
+      { 1, 0, { 1 } },
+      { 2, 1, { 1, 3 } },
+      { 3, 1, { 1, 3, 1 } },
+    };
+
+    for(size_t bit = 0; bit < 32; bit++)
+      directions[0][bit] = 1u << (31 - bit);
+
+    for(size_t dim = 1; dim < dimensions; dim++)
+    {
+      Polynomial const & p = polynomials[dim - 1];
+      auto & v = directions[dim];
+      for(size_t i = 0; i < 32; i++)
+      {
+        if(i < p.degree) {
+          v[i] = p.initial[i] << (31 - i);
+          continue;
+        }
+        v[i] = v[i - p.degree] ^ (v[i - p.degree] >> p.degree);
+        for(size_t k = 1; k < p.degree; k++) {
+          if((p.coefficients >> (p.degree - 1 - k)) & 1)
+            v[i] ^= v[i - k];
+        }
+      }
+    }
+  }
+
+  // only visits the set bits, scrambled indices have all 32 bits in use
+  uint32_t sobol(uint32_t index, size_t dim) const
+  {
+    uint32_t x = 0;
+    for(; index != 0; index &= index - 1)
+      x ^= directions[dim][__builtin_ctz(index)];
+    return x;
+  }
+
+  static uint32_t reverseBits(uint32_t x)
+  {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  // permutes the bits of `x` so that every bit only depends on the higher ones
+  static uint32_t scramble(uint32_t x, uint32_t seed)
+  {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return reverseBits(x);
+  }
+
+  Philox::Counter pixelSeeds(uint64_t pixel) const
+  {
+    return Philox::generate({ uint32_t(pixel), uint32_t(pixel >> 32), 0, 0 }, key);
+  }
+
+  void start(SampleRng & rng, size_t, size_t, Philox::Counter const & seeds, uint32_t sample) const
+  {
+    rng.stratify = &stratify;
+    rng.sampler = this;
+    rng.index = scramble(sample, seeds[0]);
+    rng.seed = seeds[1];
+    rng.stratified_count = dimensions;
+  }
+
+  static float stratify(SampleRng const & rng, size_t dim)
+  {
+    SobolSampler const & self = *static_cast<SobolSampler const *>(rng.sampler);
+    uint32_t value = scramble(self.sobol(rng.index, dim), rng.seed + uint32_t(dim) * 0x9E3779B9u);
+    return float(value >> 8) * 0x1.0p-24f;
+  }
+};
+
+// Sobol points shifted per pixel by a blue noise mask, so the remaining error
+// of neighbouring pixels is anti correlated and looks like fine grain.
+// see: https://belcour.github.io/blog/research/publication/2019/06/17/sampling-bluenoise.html
+struct BlueNoiseSampler
+{
+  static constexpr size_t dimensions = SampleRng::max_stratified;
+  static constexpr size_t mask_size = 64;
+
+  SobolSampler sobol;
+  std::vector<float> mask; // mask_size² values in [0, 1), each rank once
+
+  BlueNoiseSampler(uint32_t seed, uint32_t frame) :
+    sobol { seed, frame },
+    mask(voidAndCluster(seed))
+  {
+
+  }
+
+  // Ulichney's void and cluster method with a gaussian filter on the torus.
+  // Returns the rank of every cell, scaled to [0, 1).
+  // see: https://doi.org/10.1117/12.152707
+  static std::vector<float> voidAndCluster(uint32_t seed)
+  {
+    constexpr size_t n = mask_size;
+    constexpr size_t count = n * n;
+
+    std::vector<float> kernel(count);
+    for(size_t y = 0; y < n; y++) {
+      for(size_t x = 0; x < n; x++) {
+        float dx = float(std::min(x, n - x));
+        float dy = float(std::min(y, n - y));
+        kernel[y * n + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * 1.5f * 1.5f));
+      }
+    }
+
+    std::vector<uint8_t> points(count, 0);
+    std::vector<float> energy(count, 0.0f);
+    auto toggle = [&](size_t cell, bool set)
+    {
+      points[cell] = set;
+      size_t cx = cell % n, cy = cell / n;
+      float sign = set ? 1.0f : -1.0f;
+      for(size_t y = 0; y < n; y++) {
+        for(size_t x = 0; x < n; x++) {
+          energy[y * n + x] += sign * kernel[((y + n - cy) % n) * n + (x + n - cx) % n];
+        }
+      }
+    };
+    // the densest point or the emptiest spot
+    auto extreme = [&](bool cluster)
+    {
+      size_t best = count;
+      for(size_t i = 0; i < count; i++) {
+        if(points[i] != cluster)
+          continue;
+        if(best == count || (cluster ? energy[i] > energy[best] : energy[i] < energy[best]))
+          best = i;
+      }
+      return best;
+    };
+
+    // random initial pattern, relaxed until the tightest cluster is the largest void
+    size_t const initial = count / 10;
+    SampleRng rng { seed, 0, 0, 0xFFFFFFFE };
+    for(size_t placed = 0; placed < initial; ) {
+      size_t cell = std::min(count - 1, size_t(rng.next() * float(count)));
+      if(!points[cell]) {
+        toggle(cell, true);
+        placed++;
+      }
+    }
+    for(;;) {
+      size_t cluster = extreme(true);
+      toggle(cluster, false);
+      size_t void_ = extreme(false);
+      toggle(void_, true);
+      if(void_ == cluster)
+        break;
+    }
+
+    std::vector<uint8_t> const prototype = points;
+    std::vector<float> const prototype_energy = energy;
+    std::vector<float> ranks(count);
+
+    // ranks below the initial pattern: remove the tightest clusters
+    for(size_t rank = initial; rank-- > 0; ) {
+      size_t cell = extreme(true);
+      toggle(cell, false);
+      ranks[cell] = float(rank);
+    }
+
+    // ranks above: fill the largest voids
+    points = prototype;
+    energy = prototype_energy;
+    for(size_t rank = initial; rank < count; rank++) {
+      size_t cell = extreme(false);
+      toggle(cell, true);
+      ranks[cell] = float(rank);
+    }
+
+    for(float & rank : ranks)
+      rank = (rank + 0.5f) / float(count);
+    return ranks;
+  }
+
+  Philox::Counter pixelSeeds(uint64_t) const { return { }; }
+
+  void start(SampleRng & rng, size_t x, size_t y, Philox::Counter const &, uint32_t sample) const
+  {
+    for(size_t dim = 0; dim < dimensions; dim++)
+    {
+      // a differently offset window of the mask for each dimension
+      size_t mx = (x + dim * 23) % mask_size;
+      size_t my = (y + dim * 41) % mask_size;
+      float value = float(sobol.sobol(sample, dim) >> 8) * 0x1.0p-24f + mask[my * mask_size + mx];
+      rng.stratified[dim] = value - std::floor(value);
+    }
+    rng.stratified_count = dimensions;
+  }
+};
+
+using Sampler = std::variant<UniformSampler, SobolSampler, BlueNoiseSampler>;
+
+struct Intersection
+{
+  float distance;
+  Vec3 position;
+  Vec3 normal;
+  Material const * material;
+  uint32_t object = 0; // index in Scene::objects
+};
+
+// The closest hit of a ray, before the hit record is reconstructed
+struct Hit
+{
+  float distance;
+  uint32_t object; // index into Scene::objects
+};
+
+struct Plane
+{
+  Material * const material;
+  Vec3 origin;
+  Vec3 normal;
+  
+  // Creates the hit record for a ray that hits the primitive after `distance`
+  Intersection surface(Vec3 ray_origin, Vec3 ray_direction, float distance) const
+  {
+    return Intersection {
+      distance,
+      ray_origin + ray_direction * distance,
+      normal,
+      material,
+    };
+  }
+
+  // planes are infinite and can't be put into a bounding volume
+  std::optional<Aabb> bounds() const
+  {
+    return std::nullopt;
+  }
+};
+
+struct Sphere 
+{
+  Material * const material;
+  Vec3 center;
+  float radius;
+
+  // Creates the hit record for a ray that hits the primitive after `distance`
+  Intersection surface(Vec3 ray_origin, Vec3 ray_direction, float distance) const
+  {
+    Vec3 position = ray_origin + ray_direction * distance;
+    return Intersection {
+      distance,
+      position,
+      (position - center).normalize(),
+      material,
+    }; 
+  }
+
+  std::optional<Aabb> bounds() const
+  {
+    Vec3 r { radius, radius, radius };
+    return Aabb { center - r, center + r };
+  }
+};
+
+using Object = std::variant<Plane, Sphere>;
+
+// Minimal wrappers around the widest vector instructions the target supports.
+// Comparisons return one bit per lane, so kernels can be written once for all widths.
+// Compile with -DRAYTRACER_NO_SIMD to force the scalar fallback.
+// The kernels never fuse a multiply and an add, so the scalar code must not either
+// for all render modes to give the same image: compile with -ffp-contract=off, as
+// build.zig does, or the compiler may turn scalar expressions into FMAs.
+struct ScalarLanes
+{
+  static constexpr size_t width = 1;
+  using F = float;
+
+  static F set(float v) { return v; }
+  static F load(float const * p) { return *p; }
+  static void store(float * p, F v) { *p = v; }
+  static F add(F a, F b) { return a + b; }
+  static F sub(F a, F b) { return a - b; }
+  static F mul(F a, F b) { return a * b; }
+  static F div(F a, F b) { return a / b; }
+  static F min(F a, F b) { return std::min(a, b); }
+  static F max(F a, F b) { return std::max(a, b); }
+  static F sqrt(F a) { return std::sqrt(a); }
+  static uint32_t less(F a, F b) { return a < b; }
+  static uint32_t lessEqual(F a, F b) { return a <= b; }
+  static F selectLess(F a, F b, F x, F y) { return (a < b) ? x : y; } // a < b ? x : y
+};
+
+#if !defined(RAYTRACER_NO_SIMD) && defined(__AVX512F__)
+struct SimdLanes
+{
+  static constexpr size_t width = 16;
+  using F = __m512;
+
+  static F set(float v) { return _mm512_set1_ps(v); }
+  static F load(float const * p) { return _mm512_loadu_ps(p); }
+  static void store(float * p, F v) { _mm512_storeu_ps(p, v); }
+  static F add(F a, F b) { return _mm512_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+  static F div(F a, F b) { return _mm512_div_ps(a, b); }
+  static F min(F a, F b) { return _mm512_maskz_min_ps(0xFFFF, a, b); }
+  static F max(F a, F b) { return _mm512_maskz_max_ps(0xFFFF, a, b); }
+  static F sqrt(F a) { return _mm512_maskz_sqrt_ps(0xFFFF, a); }
+  static uint32_t less(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  static uint32_t lessEqual(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+  static F selectLess(F a, F b, F x, F y) { return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), y, x); }
+};
+#elif !defined(RAYTRACER_NO_SIMD) && defined(__AVX__)
+struct SimdLanes
+{
+  static constexpr size_t width = 8;
+  using F = __m256;
+
+  static F set(float v) { return _mm256_set1_ps(v); }
+  static F load(float const * p) { return _mm256_loadu_ps(p); }
+  static void store(float * p, F v) { _mm256_storeu_ps(p, v); }
+  static F add(F a, F b) { return _mm256_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+  static F div(F a, F b) { return _mm256_div_ps(a, b); }
+  static F min(F a, F b) { return _mm256_min_ps(a, b); }
+  static F max(F a, F b) { return _mm256_max_ps(a, b); }
+  static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+  static uint32_t less(F a, F b) { return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ))); }
+  static uint32_t lessEqual(F a, F b) { return uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ))); }
+  static F selectLess(F a, F b, F x, F y) { return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+};
+#elif !defined(RAYTRACER_NO_SIMD) && defined(__SSE2__)
+struct SimdLanes
+{
+  static constexpr size_t width = 4;
+  using F = __m128;
+
+  static F set(float v) { return _mm_set1_ps(v); }
+  static F load(float const * p) { return _mm_loadu_ps(p); }
+  static void store(float * p, F v) { _mm_storeu_ps(p, v); }
+  static F add(F a, F b) { return _mm_add_ps(a, b); }
+  static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+  static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+  static F div(F a, F b) { return _mm_div_ps(a, b); }
+  static F min(F a, F b) { return _mm_min_ps(a, b); }
+  static F max(F a, F b) { return _mm_max_ps(a, b); }
+  static F sqrt(F a) { return _mm_sqrt_ps(a); }
+  static uint32_t less(F a, F b) { return uint32_t(_mm_movemask_ps(_mm_cmplt_ps(a, b))); }
+  static uint32_t lessEqual(F a, F b) { return uint32_t(_mm_movemask_ps(_mm_cmple_ps(a, b))); }
+  static F selectLess(F a, F b, F x, F y) {
+    F mask = _mm_cmplt_ps(a, b);
+    return _mm_or_ps(_mm_and_ps(mask, x), _mm_andnot_ps(mask, y));
+  }
+};
+#else
+using SimdLanes = ScalarLanes;
+#endif
+
+// Rays that are traced together, one ray per SIMD lane.
+// Only lanes whose bit is set in `active` carry a ray.
+struct RayPacket
+{
+  static constexpr size_t size = SimdLanes::width;
+
+  // lanes that are never set stay zero, kernels load them even though they are inactive
+  float origin_x[size] = { }, origin_y[size] = { }, origin_z[size] = { };
+  float direction_x[size] = { }, direction_y[size] = { }, direction_z[size] = { };
+  float distance[size] = { }; // rays end here, closest-hit queries lower it to the closest hit
+  uint32_t object[size] = { }; // closest object, valid once a closest-hit query lowered `distance`
+  uint32_t active = 0;
+
+  void set(size_t lane, Vec3 origin, Vec3 direction, float max_distance)
+  {
+    origin_x[lane] = origin.x;
+    origin_y[lane] = origin.y;
+    origin_z[lane] = origin.z;
+    direction_x[lane] = direction.x;
+    direction_y[lane] = direction.y;
+    direction_z[lane] = direction.z;
+    distance[lane] = max_distance;
+    object[lane] = 0;
+    active |= (1u << lane);
+  }
+
+  Vec3 origin(size_t lane) const {
+    return Vec3 { origin_x[lane], origin_y[lane], origin_z[lane] };
+  }
+
+  Vec3 direction(size_t lane) const {
+    return Vec3 { direction_x[lane], direction_y[lane], direction_z[lane] };
+  }
+};
+
+struct BvhSettings
+{
+  size_t bin_count = 16;      // candidate split planes per axis, more bins give better trees
+  size_t max_leaf_size = std::max<size_t>(4, SimdLanes::width); // leaves may not hold more primitives than this
+  float traversal_cost = 1.0; // cost of visiting a node relative to intersecting a primitive
+  size_t threads = 1;         // subtrees are built in parallel on this many threads
+};
+
+struct BvhStats
+{
+  double build_time; // seconds
+  size_t node_count;
+  size_t leaf_count;
+  size_t depth;
+  float sah_cost;    // expected cost of a random ray, in units of primitive intersections
+  size_t memory;     // bytes
+};
+
+// Bounding volume hierarchy over a set of primitives.
+// The children of an inner node are stored next to each other, leaves reference
+// a contiguous range of `indices`.
+// see: https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+struct Bvh
+{
+  struct Node
+  {
+    Aabb bounds;
+    uint32_t first; // index of the first child for inner nodes, first entry in `indices` for leaves
+    uint16_t count; // number of primitives in a leaf, 0 for inner nodes
+    uint16_t axis;  // axis along which the children of an inner node are split
+  };
+
+  static constexpr size_t max_depth = 64;
+
+  std::vector<Node> nodes;
+  std::vector<uint32_t> indices;
+
+  // Builds the tree with a binned surface area heuristic.
+  // `bounds[i]` is the bounding box of primitive `i`.
+  // see: https://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf
+  BvhStats build(std::vector<Aabb> const & bounds, BvhSettings const & settings)
+  {
+    auto const start = std::chrono::steady_clock::now();
+
+    nodes.clear();
+    indices.resize(bounds.size());
+    for(size_t i = 0; i < indices.size(); i++) {
+      indices[i] = uint32_t(i);
+    }
+
+    if(!bounds.empty())
+    {
+      Builder builder { *this, bounds, settings, { } };
+      builder.centroids.resize(bounds.size());
+      for(size_t i = 0; i < bounds.size(); i++) {
+        builder.centroids[i] = bounds[i].center();
+      }
+
+      // a binary tree with at least one primitive per leaf never has more nodes
+      nodes.resize(2 * bounds.size() - 1);
+      builder.node_count = 1;
+
+      // every split level doubles the number of threads working on the tree
+      size_t parallel_depth = 0;
+      while((size_t(1) << parallel_depth) < settings.threads) {
+        parallel_depth += 1;
+      }
+
+      builder.subdivide(0, 0, bounds.size(), 1, parallel_depth);
+      nodes.resize(builder.node_count);
+      nodes.shrink_to_fit();
+    }
+
+    BvhStats stats { };
+    stats.build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats.node_count = nodes.size();
+    stats.memory = nodes.capacity() * sizeof(Node) + indices.capacity() * sizeof(uint32_t);
+    if(!nodes.empty()) {
+      float const root_area = nodes[0].bounds.surfaceArea();
+      collectStats(0, 1, root_area > 0.0f ? 1.0f / root_area : 0.0f, settings, stats);
+    }
+    return stats;
+  }
+
+  // Visits all leaves the ray passes through, near leaves first.
+  // `visit(begin, end)` receives the range of `indices` in the leaf, may lower
+  // `max_distance` to cull more nodes and returns true to stop the traversal
+  // early. Returns true if the traversal was stopped.
+  template<typename F>
+  bool traverse(Vec3 ray_origin, Vec3 ray_direction, float const & max_distance, F const & visit) const
+  {
+    if(nodes.empty())
+      return false;
+
+    Vec3 inv_direction { 1.0f / ray_direction.x, 1.0f / ray_direction.y, 1.0f / ray_direction.z };
+    bool const negative[3] = { ray_direction.x < 0, ray_direction.y < 0, ray_direction.z < 0 };
+
+    uint32_t stack[max_depth];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while(stack_size > 0)
+    {
+      Node const & node = nodes[stack[--stack_size]];
+      if(!node.bounds.intersect(ray_origin, inv_direction, max_distance))
+        continue;
+
+      if(node.count > 0) {
+        if(visit(node.first, node.first + node.count))
+          return true;
+        continue;
+      }
+
+      // push the far child first so the near one is visited first
+      if(negative[node.axis]) {
+        stack[stack_size++] = node.first;
+        stack[stack_size++] = node.first + 1;
+      } else {
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+      }
+    }
+    return false;
+  }
+
+  // Packet version of traverse(): visits every leaf that any active ray passes
+  // through. `visit(begin, end)` may update `rays.distance` and clear bits in
+  // `rays.active`, the traversal stops once no ray is active anymore.
+  template<typename F>
+  void traverse(RayPacket const & rays, F const & visit) const
+  {
+    using L = SimdLanes;
+    if(nodes.empty() || rays.active == 0)
+      return;
+
+    auto const ox = L::load(rays.origin_x);
+    auto const oy = L::load(rays.origin_y);
+    auto const oz = L::load(rays.origin_z);
+    auto const ix = L::div(L::set(1.0f), L::load(rays.direction_x));
+    auto const iy = L::div(L::set(1.0f), L::load(rays.direction_y));
+    auto const iz = L::div(L::set(1.0f), L::load(rays.direction_z));
+
+    // the rays are expected to be coherent, so the first one decides the order
+    size_t const first = firstLane(rays.active);
+    bool const negative[3] = { rays.direction_x[first] < 0, rays.direction_y[first] < 0, rays.direction_z[first] < 0 };
+
+    uint32_t stack[max_depth];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while(stack_size > 0 && rays.active != 0)
+    {
+      Node const & node = nodes[stack[--stack_size]];
+
+      auto tx0 = L::mul(L::sub(L::set(node.bounds.lower.x), ox), ix);
+      auto tx1 = L::mul(L::sub(L::set(node.bounds.upper.x), ox), ix);
+      auto ty0 = L::mul(L::sub(L::set(node.bounds.lower.y), oy), iy);
+      auto ty1 = L::mul(L::sub(L::set(node.bounds.upper.y), oy), iy);
+      auto tz0 = L::mul(L::sub(L::set(node.bounds.lower.z), oz), iz);
+      auto tz1 = L::mul(L::sub(L::set(node.bounds.upper.z), oz), iz);
+      auto t_near = L::max(L::max(L::min(tx0, tx1), L::min(ty0, ty1)), L::max(L::min(tz0, tz1), L::set(0.0f)));
+      auto t_far = L::min(L::min(L::max(tx0, tx1), L::max(ty0, ty1)), L::min(L::max(tz0, tz1), L::load(rays.distance)));
+      if((L::lessEqual(t_near, t_far) & rays.active) == 0)
+        continue;
+
+      if(node.count > 0) {
+        visit(node.first, node.first + node.count);
+        continue;
+      }
+
+      if(negative[node.axis]) {
+        stack[stack_size++] = node.first;
+        stack[stack_size++] = node.first + 1;
+      } else {
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+      }
+    }
+  }
+
+  static size_t firstLane(uint32_t mask)
+  {
+    size_t lane = 0;
+    while(((mask >> lane) & 1) == 0) {
+      lane += 1;
+    }
+    return lane;
+  }
+
+private:
+  struct Builder
+  {
+    Bvh & bvh;
+    std::vector<Aabb> const & bounds;
+    BvhSettings const & settings;
+    std::vector<Vec3> centroids;
+    std::atomic<size_t> node_count { 0 };
+
+    struct Bin
+    {
+      Aabb bounds = Aabb::empty();
+      size_t count = 0;
+    };
+
+    // `end - begin` fits into `count`: parsing limits max_leaf_size to 0xFFFF and
+    // leaves forced by max_depth are kept that small by `subdivide`
+    void makeLeaf(Node & node, size_t begin, size_t end)
+    {
+      node.first = uint32_t(begin);
+      node.count = uint16_t(end - begin);
+    }
+
+    // Splits at the object median along the widest axis of the centroids.
+    size_t medianSplit(size_t begin, size_t end, Aabb const & centroid_bounds, size_t & axis)
+    {
+      Vec3 const extent = centroid_bounds.upper - centroid_bounds.lower;
+      axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z) ? 1 : 2;
+      size_t const middle = begin + (end - begin) / 2;
+      std::nth_element(bvh.indices.begin() + begin, bvh.indices.begin() + middle, bvh.indices.begin() + end, [&](uint32_t a, uint32_t b) {
+        return axisValue(centroids[a], axis) < axisValue(centroids[b], axis);
+      });
+      return middle;
+    }
+
+    // Builds the subtree for `indices[begin, end)` into `nodes[node_index]`.
+    // The first `parallel_depth` levels build their left subtree on a new thread.
+    void subdivide(size_t node_index, size_t begin, size_t end, size_t depth, size_t parallel_depth)
+    {
+      std::vector<uint32_t> & indices = bvh.indices;
+      Node & node = bvh.nodes[node_index];
+
+      Aabb node_bounds = Aabb::empty();
+      Aabb centroid_bounds = Aabb::empty();
+      for(size_t i = begin; i < end; i++) {
+        node_bounds.extend(bounds[indices[i]]);
+        centroid_bounds.extend(centroids[indices[i]]);
+      }
+      node.bounds = node_bounds;
+
+      size_t const count = end - begin;
+      if(count <= 1 || depth >= max_depth - 1) {
+        makeLeaf(node, begin, end);
+        return;
+      }
+
+      // Unbalanced SAH splits could leave more primitives at max_depth than a leaf holds.
+      // Once only median splits, which halve the count on every level left, can avoid that,
+      // they are all that is used.
+      size_t const levels_left = max_depth - 1 - depth;
+      if(levels_left < 32 && count > (std::max<size_t>(1, settings.max_leaf_size) << levels_left))
+      {
+        size_t axis;
+        size_t const middle = medianSplit(begin, end, centroid_bounds, axis);
+        split(node, begin, middle, end, axis, depth, parallel_depth);
+        return;
+      }
+
+      // find the cheapest split plane between bins over all axes
+      size_t const bin_count = std::max<size_t>(2, settings.bin_count);
+      float best_cost = std::numeric_limits<float>::infinity();
+      size_t best_axis = 0;
+      size_t best_split = 0;
+
+      std::vector<Bin> bins(bin_count);
+      std::vector<float> right_area(bin_count);
+      std::vector<size_t> right_count(bin_count);
+
+      for(size_t axis = 0; axis < 3; axis++)
+      {
+        float const lower = axisValue(centroid_bounds.lower, axis);
+        float const extent = axisValue(centroid_bounds.upper, axis) - lower;
+        if(extent <= 0.0f)
+          continue;
+        float const scale = float(bin_count) / extent;
+
+        std::fill(bins.begin(), bins.end(), Bin { });
+        for(size_t i = begin; i < end; i++)
+        {
+          size_t b = std::min(bin_count - 1, size_t(scale * (axisValue(centroids[indices[i]], axis) - lower)));
+          bins[b].bounds.extend(bounds[indices[i]]);
+          bins[b].count += 1;
+        }
+
+        // sweep from the right to know the area and count right of every plane
+        Aabb right = Aabb::empty();
+        size_t right_sum = 0;
+        for(size_t b = bin_count - 1; b > 0; b--)
+        {
+          right.extend(bins[b].bounds);
+          right_sum += bins[b].count;
+          right_area[b] = right_sum > 0 ? right.surfaceArea() : 0.0f;
+          right_count[b] = right_sum;
+        }
+
+        // plane `b` separates bins [0, b) from bins [b, bin_count)
+        Aabb left = Aabb::empty();
+        size_t left_sum = 0;
+        for(size_t b = 1; b < bin_count; b++)
+        {
+          left.extend(bins[b - 1].bounds);
+          left_sum += bins[b - 1].count;
+          if(left_sum == 0 || right_count[b] == 0)
+            continue;
+          float cost = left.surfaceArea() * float(left_sum) + right_area[b] * float(right_count[b]);
+          if(cost < best_cost) {
+            best_cost = cost;
+            best_axis = axis;
+            best_split = b;
+          }
+        }
+      }
+
+      float const area = node_bounds.surfaceArea();
+      float const leaf_cost = float(count);
+      float const split_cost = settings.traversal_cost + (area > 0.0f ? best_cost / area : float(count));
+
+      size_t middle = begin + count / 2;
+      if(best_split > 0)
+      {
+        if(split_cost >= leaf_cost && count <= settings.max_leaf_size) {
+          makeLeaf(node, begin, end);
+          return;
+        }
+
+        float const lower = axisValue(centroid_bounds.lower, best_axis);
+        float const scale = float(bin_count) / (axisValue(centroid_bounds.upper, best_axis) - lower);
+        auto split = std::partition(indices.begin() + begin, indices.begin() + end, [&](uint32_t index) {
+          return std::min(bin_count - 1, size_t(scale * (axisValue(centroids[index], best_axis) - lower))) < best_split;
+        });
+        middle = size_t(split - indices.begin());
+      }
+      else
+      {
+        // all centroids coincide, no plane can separate them
+        if(count <= settings.max_leaf_size) {
+          makeLeaf(node, begin, end);
+          return;
+        }
+      }
+
+      split(node, begin, middle, end, best_axis, depth, parallel_depth);
+    }
+
+    // Turns `node` into an inner node with the children [begin, middle) and [middle, end).
+    void split(Node & node, size_t begin, size_t middle, size_t end, size_t axis, size_t depth, size_t parallel_depth)
+    {
+      size_t const children = node_count.fetch_add(2);
+      node.first = uint32_t(children);
+      node.count = 0;
+      node.axis = uint16_t(axis);
+
+      if(parallel_depth > 0 && end - begin >= 4096)
+      {
+        std::thread left { [=] { subdivide(children, begin, middle, depth + 1, parallel_depth - 1); } };
+        subdivide(children + 1, middle, end, depth + 1, parallel_depth - 1);
+        left.join();
+      }
+      else
+      {
+        subdivide(children, begin, middle, depth + 1, 0);
+        subdivide(children + 1, middle, end, depth + 1, 0);
+      }
+    }
+  };
+
+  static float axisValue(Vec3 v, size_t axis)
+  {
+    return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+  }
+
+  void collectStats(size_t node_index, size_t depth, float inv_root_area, BvhSettings const & settings, BvhStats & stats) const
+  {
+    Node const & node = nodes[node_index];
+    float const probability = node.bounds.surfaceArea() * inv_root_area;
+    stats.depth = std::max(stats.depth, depth);
+    if(node.count > 0) {
+      stats.leaf_count += 1;
+      stats.sah_cost += probability * float(node.count);
+    } else {
+      stats.sah_cost += probability * settings.traversal_cost;
+      collectStats(node.first, depth + 1, inv_root_area, settings, stats);
+      collectStats(node.first + 1, depth + 1, inv_root_area, settings, stats);
+    }
+  }
+};
+
+
+// Structure of arrays storage for all primitives of type `T`.
+// Every type in `Object` needs a specialization with the same interface.
+template<typename T>
+struct PrimitiveArray;
+
+template<>
+struct PrimitiveArray<Plane>
+{
+  // plane equation: dot(normal, p) == distance
+  std::vector<float> normal_x, normal_y, normal_z;
+  std::vector<float> distance;
+  std::vector<uint32_t> object;
+
+  void add(Plane const & plane, uint32_t index)
+  {
+    normal_x.push_back(plane.normal.x);
+    normal_y.push_back(plane.normal.y);
+    normal_z.push_back(plane.normal.z);
+    distance.push_back(plane.normal.dot(plane.origin));
+    object.push_back(index);
+  }
+
+  // planes are infinite and can't be put into a bounding volume, so every ray tests all of them
+  BvhStats build(BvhSettings const &)
+  {
+    BvhStats stats { };
+    stats.sah_cost = float(object.size());
+    return stats;
+  }
+
+  // https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-plane-and-ray-disk-intersection
+  void closestHit(Vec3 ray_origin, Vec3 ray_direction, Hit & hit) const
+  {
+    for(size_t i = 0; i < object.size(); i++)
+    {
+      // assuming vectors are all normalized
+      float denom = normal_x[i] * ray_direction.x + normal_y[i] * ray_direction.y + normal_z[i] * ray_direction.z;
+      float t = (distance[i] - (normal_x[i] * ray_origin.x + normal_y[i] * ray_origin.y + normal_z[i] * ray_origin.z)) / denom;
+      if(denom < -1e-6f && t >= 0 && t < hit.distance) {
+        hit = Hit { t, object[i] };
+      }
+    }
+  }
+
+  bool occluded(Vec3 ray_origin, Vec3 ray_direction, float max_distance) const
+  {
+    for(size_t i = 0; i < object.size(); i++)
+    {
+      float denom = normal_x[i] * ray_direction.x + normal_y[i] * ray_direction.y + normal_z[i] * ray_direction.z;
+      float t = (distance[i] - (normal_x[i] * ray_origin.x + normal_y[i] * ray_origin.y + normal_z[i] * ray_origin.z)) / denom;
+      if(denom < -1e-6f && t >= 0 && t < max_distance)
+        return true;
+    }
+    return false;
+  }
+
+  // Tests one plane against all rays of the packet at once, returns the lanes
+  // that hit it before their `distance` and stores the distances in `distances`.
+  uint32_t distancesTo(size_t i, RayPacket const & rays, float * distances) const
+  {
+    using L = SimdLanes;
+    auto nx = L::set(normal_x[i]);
+    auto ny = L::set(normal_y[i]);
+    auto nz = L::set(normal_z[i]);
+    auto denom = L::add(L::add(L::mul(nx, L::load(rays.direction_x)), L::mul(ny, L::load(rays.direction_y))), L::mul(nz, L::load(rays.direction_z)));
+    auto offset = L::add(L::add(L::mul(nx, L::load(rays.origin_x)), L::mul(ny, L::load(rays.origin_y))), L::mul(nz, L::load(rays.origin_z)));
+    auto t = L::div(L::sub(L::set(distance[i]), offset), denom);
+    L::store(distances, t);
+    return L::less(denom, L::set(-1e-6f)) & L::lessEqual(L::set(0.0f), t) & L::less(t, L::load(rays.distance)) & rays.active;
+  }
+
+  void closestHit(RayPacket & rays) const
+  {
+    for(size_t i = 0; i < object.size(); i++)
+    {
+      float distances[RayPacket::size];
+      uint32_t mask = distancesTo(i, rays, distances);
+      for(size_t lane = 0; mask != 0; lane++, mask >>= 1)
+      {
+        if(mask & 1) {
+          rays.distance[lane] = distances[lane];
+          rays.object[lane] = object[i];
+        }
+      }
+    }
+  }
+
+  void occluded(RayPacket & rays) const
+  {
+    for(size_t i = 0; i < object.size() && rays.active != 0; i++)
+    {
+      float distances[RayPacket::size];
+      rays.active &= ~distancesTo(i, rays, distances);
+    }
+  }
+};
+
+template<>
+struct PrimitiveArray<Sphere>
+{
+  // sorted in bvh leaf order, so every leaf is a contiguous range
+  std::vector<float> center_x, center_y, center_z;
+  std::vector<float> radius2;
+  std::vector<uint32_t> object;
+  Bvh bvh;
+
+  void add(Sphere const & sphere, uint32_t index)
+  {
+    center_x.push_back(sphere.center.x);
+    center_y.push_back(sphere.center.y);
+    center_z.push_back(sphere.center.z);
+    radius2.push_back(sphere.radius * sphere.radius);
+    object.push_back(index);
+  }
+
+  BvhStats build(BvhSettings const & settings)
+  {
+    std::vector<Aabb> bounds(object.size());
+    for(size_t i = 0; i < object.size(); i++)
+    {
+      Vec3 center { center_x[i], center_y[i], center_z[i] };
+      float radius = std::sqrt(radius2[i]);
+      bounds[i] = Aabb { center - Vec3(radius, radius, radius), center + Vec3(radius, radius, radius) };
+    }
+
+    BvhStats stats = bvh.build(bounds, settings);
+
+    auto reorder = [&](auto & values) {
+      auto sorted = values;
+      for(size_t i = 0; i < bvh.indices.size(); i++) {
+        sorted[i] = values[bvh.indices[i]];
+      }
+      values = std::move(sorted);
+    };
+    reorder(center_x);
+    reorder(center_y);
+    reorder(center_z);
+    reorder(radius2);
+    reorder(object);
+
+    // pad the arrays so the vector kernels can always load full registers,
+    // the padding never hits because its squared radius is negative
+    for(size_t i = 1; i < SimdLanes::width; i++)
+    {
+      center_x.push_back(0.0f);
+      center_y.push_back(0.0f);
+      center_z.push_back(0.0f);
+      radius2.push_back(-std::numeric_limits<float>::infinity());
+      object.push_back(0);
+    }
+
+    return stats;
+  }
+
+  // Intersects the ray with the spheres [i, i + Lanes::width) and stores the
+  // distances in `distances`. Returns a bit mask of the lanes that were hit
+  // in front of the origin and closer than `max_distance`.
+  // https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
+  template<typename Lanes>
+  uint32_t distancesTo(size_t i, Vec3 ray_origin, Vec3 ray_direction, float max_distance, float * distances) const
+  {
+    using L = Lanes;
+    auto Lx = L::sub(L::load(&center_x[i]), L::set(ray_origin.x));
+    auto Ly = L::sub(L::load(&center_y[i]), L::set(ray_origin.y));
+    auto Lz = L::sub(L::load(&center_z[i]), L::set(ray_origin.z));
+    auto tca = L::add(L::add(L::mul(Lx, L::set(ray_direction.x)), L::mul(Ly, L::set(ray_direction.y))), L::mul(Lz, L::set(ray_direction.z)));
+    auto d2 = L::sub(L::add(L::add(L::mul(Lx, Lx), L::mul(Ly, Ly)), L::mul(Lz, Lz)), L::mul(tca, tca));
+    auto r2 = L::load(&radius2[i]);
+
+    auto thc = L::sqrt(L::max(L::sub(r2, d2), L::set(0.0f)));
+    auto t0 = L::sub(tca, thc);
+    auto t1 = L::add(tca, thc);
+
+    // if t0 is negative, let's use t1 instead
+    auto t = L::selectLess(t0, L::set(0.0f), t1, t0);
+    L::store(distances, t);
+
+    return L::lessEqual(d2, r2) & L::lessEqual(L::set(0.0f), t) & L::less(t, L::set(max_distance));
+  }
+
+  // Finds the closest sphere in [begin, end), Lanes::width spheres at a time.
+  template<typename Lanes>
+  void nearest(uint32_t begin, uint32_t end, Vec3 ray_origin, Vec3 ray_direction, Hit & hit) const
+  {
+    for(uint32_t i = begin; i < end; i += Lanes::width)
+    {
+      float distances[Lanes::width];
+      uint32_t mask = distancesTo<Lanes>(i, ray_origin, ray_direction, hit.distance, distances) & activeLanes<Lanes>(end - i);
+      for(size_t lane = 0; mask != 0; lane++, mask >>= 1)
+      {
+        if((mask & 1) && distances[lane] < hit.distance) {
+          hit = Hit { distances[lane], object[i + lane] };
+        }
+      }
+    }
+  }
+
+  template<typename Lanes>
+  bool any(uint32_t begin, uint32_t end, Vec3 ray_origin, Vec3 ray_direction, float max_distance) const
+  {
+    for(uint32_t i = begin; i < end; i += Lanes::width)
+    {
+      float distances[Lanes::width];
+      if(distancesTo<Lanes>(i, ray_origin, ray_direction, max_distance, distances) & activeLanes<Lanes>(end - i))
+        return true;
+    }
+    return false;
+  }
+
+  // bit mask of the first `count` lanes
+  template<typename Lanes>
+  static uint32_t activeLanes(size_t count)
+  {
+    return (count >= Lanes::width) ? uint32_t((uint64_t(1) << Lanes::width) - 1) : uint32_t((uint64_t(1) << count) - 1);
+  }
+
+  void closestHit(Vec3 ray_origin, Vec3 ray_direction, Hit & hit) const
+  {
+    bvh.traverse(ray_origin, ray_direction, hit.distance, [&](uint32_t begin, uint32_t end) {
+      nearest<SimdLanes>(begin, end, ray_origin, ray_direction, hit);
+      return false;
+    });
+  }
+
+  bool occluded(Vec3 ray_origin, Vec3 ray_direction, float max_distance) const
+  {
+    return bvh.traverse(ray_origin, ray_direction, max_distance, [&](uint32_t begin, uint32_t end) {
+      return any<SimdLanes>(begin, end, ray_origin, ray_direction, max_distance);
+    });
+  }
+
+  // Tests one sphere against all rays of the packet at once, returns the lanes
+  // that hit it before their `distance` and stores the distances in `distances`.
+  uint32_t distancesTo(size_t i, RayPacket const & rays, float * distances) const
+  {
+    using L = SimdLanes;
+    auto dx = L::load(rays.direction_x);
+    auto dy = L::load(rays.direction_y);
+    auto dz = L::load(rays.direction_z);
+    auto Lx = L::sub(L::set(center_x[i]), L::load(rays.origin_x));
+    auto Ly = L::sub(L::set(center_y[i]), L::load(rays.origin_y));
+    auto Lz = L::sub(L::set(center_z[i]), L::load(rays.origin_z));
+    auto tca = L::add(L::add(L::mul(Lx, dx), L::mul(Ly, dy)), L::mul(Lz, dz));
+    auto d2 = L::sub(L::add(L::add(L::mul(Lx, Lx), L::mul(Ly, Ly)), L::mul(Lz, Lz)), L::mul(tca, tca));
+    auto r2 = L::set(radius2[i]);
+
+    auto thc = L::sqrt(L::max(L::sub(r2, d2), L::set(0.0f)));
+    auto t0 = L::sub(tca, thc);
+    auto t1 = L::add(tca, thc);
+    auto t = L::selectLess(t0, L::set(0.0f), t1, t0);
+    L::store(distances, t);
+
+    return L::lessEqual(d2, r2) & L::lessEqual(L::set(0.0f), t) & L::less(t, L::load(rays.distance)) & rays.active;
+  }
+
+  void closestHit(RayPacket & rays) const
+  {
+    bvh.traverse(rays, [&](uint32_t begin, uint32_t end) {
+      for(uint32_t i = begin; i < end; i++)
+      {
+        float distances[RayPacket::size];
+        uint32_t mask = distancesTo(i, rays, distances);
+        for(size_t lane = 0; mask != 0; lane++, mask >>= 1)
+        {
+          if(mask & 1) {
+            rays.distance[lane] = distances[lane];
+            rays.object[lane] = object[i];
+          }
+        }
+      }
+    });
+  }
+
+  void occluded(RayPacket & rays) const
+  {
+    bvh.traverse(rays, [&](uint32_t begin, uint32_t end) {
+      for(uint32_t i = begin; i < end && rays.active != 0; i++)
+      {
+        float distances[RayPacket::size];
+        rays.active &= ~distancesTo(i, rays, distances);
+      }
+    });
+  }
+};
+
+// One PrimitiveArray per primitive type, all operations are dispatched at compile time.
+template<typename... Types>
+struct TypedStorage
+{
+  std::tuple<PrimitiveArray<Types>...> arrays;
+
+  template<typename T>
+  void add(T const & primitive, uint32_t index)
+  {
+    std::get<PrimitiveArray<T>>(arrays).add(primitive, index);
+  }
+
+  // calls `f(array)` for every primitive array
+  template<typename F>
+  void forEach(F const & f)
+  {
+    std::apply([&](auto & ... array) { (f(array), ...); }, arrays);
+  }
+
+  template<typename F>
+  void forEach(F const & f) const
+  {
+    std::apply([&](auto const & ... array) { (f(array), ...); }, arrays);
+  }
+
+  // true if `f(array)` is true for any primitive array, stops at the first one
+  template<typename F>
+  bool any(F const & f) const
+  {
+    return std::apply([&](auto const & ... array) { return (f(array) || ...); }, arrays);
+  }
+};
+
+template<typename Variant>
+struct StorageFor;
+
+template<typename... Types>
+struct StorageFor<std::variant<Types...>>
+{
+  using type = TypedStorage<Types...>;
+};
+
+using SceneStorage = typename StorageFor<Object>::type;
+
+// Running mean and variance of the brightness of a pixel's samples
+// https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance#Welford's_online_algorithm
+struct PixelEstimate
+{
+  Color sum;
+  size_t count = 0;
+  double mean = 0.0;
+  double m2 = 0.0;
+
+  void add(Color sample)
+  {
+    sum += sample;
+    count += 1;
+
+    double value = sample.brightness();
+    double delta = value - mean;
+    mean += delta / double(count);
+    m2 += delta * (value - mean);
+  }
+
+  // true if the standard error of the mean is below `threshold` relative to the mean
+  bool converged(float threshold) const
+  {
+    if(count < 2)
+      return false;
+    double variance = m2 / double(count - 1);
+    double error = std::sqrt(variance / double(count));
+    return error <= threshold * (mean + 1e-3);
+  }
+
+  // The same test for samples that are only known by their per channel sums,
+  // as after resuming from a checkpoint. Without the covariances the standard
+  // deviation of the brightness can only be bounded from above by the
+  // weighted deviations of the channels, so this errs towards more samples.
+  static bool converged(Color sum, Color sum_squares, size_t count, float threshold)
+  {
+    if(count < 2)
+      return false;
+    double const n = double(count);
+    auto deviation = [n](double s, double s2) { return std::sqrt(std::max(0.0, (s2 - s * s / n) / (n - 1.0))); };
+    double bound = 0.299 * deviation(sum.r, sum_squares.r) + 0.587 * deviation(sum.g, sum_squares.g) + 0.114 * deviation(sum.b, sum_squares.b);
+    double mean = sum.brightness() / n;
+    return bound / std::sqrt(n) <= threshold * (mean + 1e-3);
+  }
+};
+
+struct TraceSettings
+{
+  size_t max_depth = 10;             // maximum number of reflections along a path
+  float min_throughput = 0.0;        // paths that can't contribute more than this are stopped
+  size_t russian_roulette_depth = 0; // paths may be stopped randomly from this depth on, 0 disables it
+};
+
+struct Scene
+{
+  std::vector<Object> objects;
+  std::vector<PointLight> lights;
+
+  // acceleration structure, created by build()
+  SceneStorage storage;
+
+  // Must be called after `objects` was changed and before rendering.
+  BvhStats build(BvhSettings const & settings)
+  {
+    storage = SceneStorage { };
+    for(size_t i = 0; i < objects.size(); i++)
+    {
+      std::visit([&](auto & obj) {
+        storage.add(obj, uint32_t(i));
+      }, objects[i]);
+    }
+
+    BvhStats stats { };
+    storage.forEach([&](auto & array) {
+      BvhStats part = array.build(settings);
+      stats.build_time += part.build_time;
+      stats.node_count += part.node_count;
+      stats.leaf_count += part.leaf_count;
+      stats.depth = std::max(stats.depth, part.depth);
+      stats.sah_cost += part.sah_cost;
+      stats.memory += part.memory;
+    });
+    return stats;
+  }
+
+  // Closest-hit query: finds the nearest object along the ray.
+  // Only the distance is computed per candidate, see intersect() for the full hit record.
+  std::optional<Hit> closestHit(Vec3 ray_origin, Vec3 ray_direction) const 
+  {
+    Hit final_hit { std::numeric_limits<float>::max(), 0 };
+
+    storage.forEach([&](auto const & array) {
+      array.closestHit(ray_origin, ray_direction, final_hit);
+    });
+
+    if(final_hit.distance != std::numeric_limits<float>::max()) {
+      return final_hit;
+    } else {
+      return std::nullopt;
+    }
+  }
+
+  std::optional<Intersection> intersect(Vec3 ray_origin, Vec3 ray_direction) const 
+  {
+    auto hit = closestHit(ray_origin, ray_direction);
+    if(hit == std::nullopt)
+      return std::nullopt;
+    return surface(ray_origin, ray_direction, *hit);
+  }
+
+  Intersection surface(Vec3 ray_origin, Vec3 ray_direction, Hit hit) const
+  {
+    Intersection intersection = std::visit([&](auto & obj) {
+      return obj.surface(ray_origin, ray_direction, hit.distance);
+    }, objects[hit.object]);
+    intersection.object = hit.object;
+    return intersection;
+  }
+
+  // Any-hit query: true if something blocks the ray before `max_distance`.
+  // Stops at the first blocker instead of searching for the closest one.
+  bool occluded(Vec3 ray_origin, Vec3 ray_direction, float max_distance) const
+  {
+    return storage.any([&](auto const & array) {
+      return array.occluded(ray_origin, ray_direction, max_distance);
+    });
+  }
+
+  // Packet version of closestHit(), stores the result in `rays.distance` and `rays.object`.
+  void closestHit(RayPacket & rays) const
+  {
+    storage.forEach([&](auto const & array) {
+      array.closestHit(rays);
+    });
+  }
+
+  // Packet version of occluded(), clears the active bit of every blocked ray.
+  void occluded(RayPacket & rays) const
+  {
+    storage.any([&](auto const & array) {
+      array.occluded(rays);
+      return rays.active == 0;
+    });
+  }
+
+  // The shadow ray is cast from the light to the surface
+  struct ShadowRay
+  {
+    Vec3 direction;
+    float distance;
+  };
+
+  static ShadowRay shadowRay(PointLight const & light, Vec3 position)
+  {
+    Vec3 light_delta = (position - light.position);
+    return ShadowRay { light_delta.normalize(), light_delta.length() };
+  }
+
+  // Light reflected by a surface lit by an unobstructed light
+  static Color illumination(PointLight const & light, ShadowRay const & ray, Vec3 normal)
+  {
+    // How strong is the light after a certain distance
+    float attenuation = light.power / ray.distance;
+  
+    // How much is the light reflected by the surface
+    float brdf = std::max(0.0f, -ray.direction.dot(normal));
+
+    return light.color * attenuation * brdf;
+  }
+
+  // The lighting every surface gets before the illumination of its lights is added
+  static Color ambientLighting()
+  {
+    return Color { 0.1 }; // fake some basic ambient lighting
+  }
+
+  // Only surfaces that reflect any light need their lights checked
+  static bool receivesLight(Intersection const & intersection)
+  {
+    return intersection.material->albedo.brightness() > 0.0;
+  }
+
+  // Color of a surface point under `lighting`, which is ambientLighting()
+  // plus the illumination() of every light the point sees.
+  // Shared by all render modes, which only differ in how they cast the shadow rays.
+  static Color shade(Intersection const & intersection, Color const & lighting)
+  {
+    Color color = intersection.material->albedo;
+    if(receivesLight(intersection))
+      color *= lighting;
+    return color;
+  }
+
+  // Direct lighting of a surface point, without reflections
+  Color shade(Intersection const & intersection) const
+  {
+    Color lighting = ambientLighting();
+    if(receivesLight(intersection))
+    {
+      for(auto const & light : lights)
+      {
+        ShadowRay shadow = shadowRay(light, intersection.position);
+        if(occluded(light.position, shadow.direction, shadow.distance - 1e-3f)) { // needs tiny delta due to imprecision
+          // ray to light is obstructed
+          continue;
+        }
+        lighting += illumination(light, shadow, intersection.normal);
+      }
+    }
+    return shade(intersection, lighting);
+  }
+
+  // Decides if a path continues with a reflection off `intersection` after
+  // `depth` bounces and updates the path throughput accordingly.
+  static bool reflects(Intersection const & intersection, size_t depth, Color & throughput, TraceSettings const & settings, SampleRng & rng)
+  {
+    float reflectivity = intersection.material->reflectivity;
+    if(reflectivity <= 0.0 || depth >= settings.max_depth)
+      return false;
+
+    throughput = throughput * reflectivity;
+    if(throughput.maximum() < settings.min_throughput)
+      return false; // further bounces can't be seen anymore
+
+    // https://www.pbr-book.org/3ed-2018/Monte_Carlo_Integration/Russian_Roulette_and_Splitting
+    if(settings.russian_roulette_depth > 0 && depth + 1 >= settings.russian_roulette_depth)
+    {
+      float survival = std::min(1.0f, throughput.maximum());
+      if(rng.next() >= survival)
+        return false;
+      throughput = throughput * (1.0f / survival);
+    }
+    return true;
+  }
+
+  // Follows a path through all its reflections, starting after `depth` bounces
+  // with the given `throughput`. Returns nullopt if the first ray hits nothing.
+  std::optional<Color> trace(Vec3 ray_origin, Vec3 ray_direction, TraceSettings const & settings, SampleRng & rng, Color throughput = Color(1.0), size_t depth = 0) const 
+  {
+    auto intersection = intersect(ray_origin, ray_direction);
+    if(intersection == std::nullopt)
+      return std::nullopt;
+    return trace(*intersection, ray_direction, settings, rng, throughput, depth);
+  }
+
+  // The same for a path whose ray in `ray_direction` already hit `first`.
+  Color trace(Intersection const & first, Vec3 ray_direction, TraceSettings const & settings, SampleRng & rng, Color throughput = Color(1.0), size_t depth = 0) const
+  {
+    std::optional<Intersection> intersection = first;
+    Color radiance { 0.0 };
+    while(true)
+    {
+      radiance += throughput * shade(*intersection);
+
+      if(!reflects(*intersection, depth, throughput, settings, rng))
+        break;
+
+      ray_direction = ray_direction.reflect(intersection->normal);
+      Vec3 ray_origin = intersection->position + ray_direction * 1e-4;
+      depth += 1;
+
+      intersection = intersect(ray_origin, ray_direction);
+      if(intersection == std::nullopt)
+        break;
+    }
+    return radiance;
+  }
+
+  // Traces the active rays of `rays` together up to their first hit, including
+  // the shadow rays. Reflections diverge, so they continue as single rays.
+  // `rngs` holds the random numbers of every lane.
+  // Returns the mask of rays that hit anything, their color is stored in
+  // `colors` and what they hit first in `surfaces`.
+  uint32_t trace(RayPacket rays, Color (&colors)[RayPacket::size], std::optional<Intersection> (&surfaces)[RayPacket::size], TraceSettings const & settings, SampleRng * rngs) const
+  {
+    size_t const lanes = RayPacket::size;
+    for(size_t lane = 0; lane < lanes; lane++) {
+      rays.distance[lane] = std::numeric_limits<float>::max();
+      surfaces[lane] = std::nullopt;
+    }
+    closestHit(rays);
+
+    Color lighting[lanes];
+    uint32_t lit = 0;
+    for(size_t lane = 0; lane < lanes; lane++)
+    {
+      if(!(rays.active & (1u << lane)) || rays.distance[lane] == std::numeric_limits<float>::max())
+        continue;
+      surfaces[lane] = surface(rays.origin(lane), rays.direction(lane), Hit { rays.distance[lane], rays.object[lane] });
+      lighting[lane] = ambientLighting();
+      if(receivesLight(*surfaces[lane]))
+        lit |= (1u << lane);
+    }
+
+    for(auto const & light : lights)
+    {
+      if(lit == 0)
+        break;
+
+      ShadowRay shadows[lanes];
+      RayPacket shadow_rays;
+      for(size_t lane = 0; lane < lanes; lane++)
+      {
+        if(lit & (1u << lane)) {
+          shadows[lane] = shadowRay(light, surfaces[lane]->position);
+          shadow_rays.set(lane, light.position, shadows[lane].direction, shadows[lane].distance - 1e-3f);
+        } else {
+          shadow_rays.set(lane, light.position, Vec3 { 0, 0, 1 }, 0.0f);
+        }
+      }
+      shadow_rays.active = lit;
+
+      occluded(shadow_rays);
+      for(size_t lane = 0; lane < lanes; lane++)
+      {
+        if(shadow_rays.active & (1u << lane)) {
+          lighting[lane] += illumination(light, shadows[lane], surfaces[lane]->normal);
+        }
+      }
+    }
+
+    uint32_t mask = 0;
+    for(size_t lane = 0; lane < lanes; lane++)
+    {
+      if(surfaces[lane] == std::nullopt)
+        continue;
+      mask |= (1u << lane);
+
+      colors[lane] = shade(*surfaces[lane], lighting[lane]);
+
+      Color throughput { 1.0 };
+      if(reflects(*surfaces[lane], 0, throughput, settings, rngs[lane]))
+      {
+        Vec3 refl_dir = rays.direction(lane).reflect(surfaces[lane]->normal);
+        Vec3 refl_origin = surfaces[lane]->position + refl_dir * 1e-4;
+        if(auto reflection = trace(refl_origin, refl_dir, settings, rngs[lane], throughput, 1))
+          colors[lane] += *reflection;
+      }
+    }
+    return mask;
+  }
+};
+
+// Threads that live as long as the process and run batches of work for
+// WorkStealingPool, so a render that runs thousands of small batches (one
+// per pass, band or filter iteration) doesn't start and join threads for
+// every one of them. Threads are added when a batch needs more than exist.
+// One batch runs at a time, callers that find the threads busy get `false`
+// and do the work themselves.
+struct WorkerThreads
+{
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  std::vector<std::thread> threads;
+  std::atomic<bool> busy { false }; // a batch is running
+
+  // the current batch: threads with an index below `count` call `call(context, index)`
+  void (*call)(void const *, size_t) = nullptr;
+  void const * context = nullptr;
+  size_t count = 0;
+  size_t remaining = 0;
+  uint64_t epoch = 0;
+  bool stop = false;
+
+  ~WorkerThreads()
+  {
+    {
+      std::lock_guard<std::mutex> guard { mutex };
+      stop = true;
+    }
+    wake.notify_all();
+    for(std::thread & t : threads)
+      t.join();
+  }
+
+  static WorkerThreads & instance()
+  {
+    static WorkerThreads workers;
+    return workers;
+  }
+
+  // Calls `f(index)` for every index in [0, n) on n threads and `own()` on
+  // the calling thread, then waits for all of them.
+  template<typename F, typename G>
+  bool execute(size_t n, F const & f, G const & own)
+  {
+    // also keeps jobs of a batch from starting a nested one
+    bool idle = false;
+    if(!busy.compare_exchange_strong(idle, true))
+      return false;
+
+    {
+      std::lock_guard<std::mutex> guard { mutex };
+      while(threads.size() < n) {
+        size_t const index = threads.size();
+        threads.emplace_back([this, index] { loop(index); });
+      }
+      call = [](void const * context, size_t index) { (*static_cast<F const *>(context))(index); };
+      context = &f;
+      count = n;
+      remaining = n;
+      epoch++;
+    }
+    wake.notify_all();
+
+    own();
+
+    {
+      std::unique_lock<std::mutex> lock { mutex };
+      done.wait(lock, [&] { return remaining == 0; });
+    }
+    busy = false;
+    return true;
+  }
+
+private:
+  void loop(size_t index)
+  {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock { mutex };
+    while(true)
+    {
+      wake.wait(lock, [&] { return stop || (epoch != seen && index < count); });
+      if(stop)
+        return;
+      seen = epoch;
+
+      lock.unlock();
+      call(context, index);
+      lock.lock();
+
+      if(--remaining == 0)
+        done.notify_all();
+    }
+  }
+};
+
+// Runs a fixed number of jobs on up to `thread_count` of the WorkerThreads.
+// Every worker owns a queue that is pre-filled with a contiguous block of jobs.
+// Workers process their own queue front to back and, when it runs dry, steal
+// from the back of the other queues, so uneven jobs still keep all cores busy.
+struct WorkStealingPool
+{
+  struct Queue
+  {
+    std::mutex lock;
+    std::deque<size_t> jobs;
+  };
+
+  size_t thread_count;
+
+  explicit WorkStealingPool(size_t thread_count) :
+    thread_count(std::max<size_t>(1, thread_count))
+  {
+
+  }
+
+  // Calls `job(index, worker)` exactly once for every index in [0, job_count).
+  // `worker` is below thread_count and unique among the jobs running at once.
+  template<typename F>
+  void run(size_t job_count, F const & job) const
+  {
+    size_t const workers = std::max<size_t>(1, std::min(thread_count, job_count));
+
+    std::vector<Queue> queues(workers);
+    for(size_t w = 0; w < workers; w++)
+    {
+      size_t begin = job_count * w / workers;
+      size_t end = job_count * (w + 1) / workers;
+      for(size_t i = begin; i < end; i++) {
+        queues[w].jobs.push_back(i);
+      }
+    }
+
+    auto worker = [&](size_t self)
+    {
+      while(true)
+      {
+        std::optional<size_t> next;
+        {
+          std::lock_guard<std::mutex> guard { queues[self].lock };
+          if(!queues[self].jobs.empty()) {
+            next = queues[self].jobs.front();
+            queues[self].jobs.pop_front();
+          }
+        }
+
+        for(size_t i = 1; i < workers && next == std::nullopt; i++)
+        {
+          Queue & victim = queues[(self + i) % workers];
+          std::lock_guard<std::mutex> guard { victim.lock };
+          if(!victim.jobs.empty()) {
+            next = victim.jobs.back();
+            victim.jobs.pop_back();
+          }
+        }
+
+        // jobs are never added while running, so all queues are empty now
+        if(next == std::nullopt)
+          return;
+
+        job(*next, self);
+      }
+    };
+
+    // the calling thread is worker 0; when the threads are busy with another
+    // batch, it steals all the jobs itself
+    auto others = [&](size_t index) { worker(index + 1); };
+    if(workers == 1 || !WorkerThreads::instance().execute(workers - 1, others, [&] { worker(0); }))
+      worker(0);
+  }
+};
+
+// Structure of arrays queue of rays for the wavefront renderer.
+// `owner` links a ray to the path or hit it was spawned for.
+struct RayQueue
+{
+  std::vector<float> origin_x, origin_y, origin_z;
+  std::vector<float> direction_x, direction_y, direction_z;
+  std::vector<float> distance;
+  std::vector<uint32_t> object;
+  std::vector<uint32_t> owner;
+
+  size_t size() const {
+    return owner.size();
+  }
+
+  void clear()
+  {
+    for(auto * v : { &origin_x, &origin_y, &origin_z, &direction_x, &direction_y, &direction_z, &distance }) {
+      v->clear();
+    }
+    object.clear();
+    owner.clear();
+  }
+
+  void push(Vec3 origin, Vec3 direction, float max_distance, uint32_t ray_owner)
+  {
+    origin_x.push_back(origin.x);
+    origin_y.push_back(origin.y);
+    origin_z.push_back(origin.z);
+    direction_x.push_back(direction.x);
+    direction_y.push_back(direction.y);
+    direction_z.push_back(direction.z);
+    distance.push_back(max_distance);
+    object.push_back(0);
+    owner.push_back(ray_owner);
+  }
+
+  Vec3 origin(size_t i) const {
+    return Vec3 { origin_x[i], origin_y[i], origin_z[i] };
+  }
+
+  Vec3 direction(size_t i) const {
+    return Vec3 { direction_x[i], direction_y[i], direction_z[i] };
+  }
+
+  // Sorts the rays by the octant of their direction, so rays that traverse
+  // the scene in the same order are processed together.
+  void sortByDirection()
+  {
+    std::vector<uint32_t> order(size());
+    for(size_t i = 0; i < order.size(); i++) {
+      order[i] = uint32_t(i);
+    }
+    auto octant = [&](uint32_t i) {
+      return (direction_x[i] < 0) | ((direction_y[i] < 0) << 1) | ((direction_z[i] < 0) << 2);
+    };
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return octant(a) < octant(b);
+    });
+
+    auto apply = [&](auto & values) {
+      auto sorted = values;
+      for(size_t i = 0; i < order.size(); i++) {
+        sorted[i] = values[order[i]];
+      }
+      values = std::move(sorted);
+    };
+    for(auto * v : { &origin_x, &origin_y, &origin_z, &direction_x, &direction_y, &direction_z, &distance }) {
+      apply(*v);
+    }
+    apply(object);
+    apply(owner);
+  }
+
+  // Closest-hit stage: stores the closest hit of every ray in `distance` and `object`
+  void closestHit(Scene const & scene)
+  {
+    for(size_t first = 0; first < size(); first += RayPacket::size)
+    {
+      RayPacket rays = packet(first);
+      scene.closestHit(rays);
+      for(size_t lane = 0; lane < RayPacket::size && first + lane < size(); lane++) {
+        distance[first + lane] = rays.distance[lane];
+        object[first + lane] = rays.object[lane];
+      }
+    }
+  }
+
+  // Any-hit stage: clears `distance` of every ray that is blocked
+  void occluded(Scene const & scene)
+  {
+    for(size_t first = 0; first < size(); first += RayPacket::size)
+    {
+      RayPacket rays = packet(first);
+      uint32_t const active = rays.active;
+      scene.occluded(rays);
+      for(size_t lane = 0; lane < RayPacket::size; lane++) {
+        if((active & ~rays.active) & (1u << lane))
+          distance[first + lane] = 0.0f;
+      }
+    }
+  }
+
+private:
+  RayPacket packet(size_t first) const
+  {
+    RayPacket rays;
+    for(size_t lane = 0; lane < RayPacket::size && first + lane < size(); lane++) {
+      rays.set(lane, origin(first + lane), direction(first + lane), distance[first + lane]);
+    }
+    return rays;
+  }
+};
+
+// Queues and path state of the wavefront renderer, reused between tiles.
+struct Wavefront
+{
+  // paths per wave, the samples of a tile are split into waves of about this many
+  static constexpr size_t max_paths = 16384;
+
+  // one path per sample
+  std::vector<Color> radiance;
+  std::vector<Color> throughput;
+  std::vector<SampleRng> rng;
+  std::vector<uint8_t> hit_anything;
+  std::vector<float> center_offset; // of the primary ray, for the feature buffers
+
+  // the surfaces hit by the current bounce
+  struct Hits
+  {
+    std::vector<uint32_t> path;
+    std::vector<Vec3> incoming;
+    std::vector<Intersection> surface;
+    std::vector<Color> lighting;
+
+    void clear()
+    {
+      path.clear();
+      incoming.clear();
+      surface.clear();
+      lighting.clear();
+    }
+  };
+
+  RayQueue rays;
+  RayQueue next_rays;
+  RayQueue shadow_rays;
+  std::vector<uint32_t> shadow_lights;       // light of every shadow ray
+  std::vector<Scene::ShadowRay> shadows;     // and its unshortened direction and length
+  Hits hits;
+  Hits sorted_hits;
+};
+
+struct Tile
+{
+  size_t x, y;
+  size_t width, height;
+};
+
+enum class SamplerType
+{
+  uniform,
+  sobol,
+  blue_noise,
+};
+
+enum class TraceMode
+{
+  single,    // every sample is traced on its own
+  packets,   // the samples of a pixel are traced together in SIMD packets
+  wavefront, // all samples of a tile advance stage by stage through ray queues
+};
+
+struct AdaptiveSettings
+{
+  float threshold = 0.0;   // stop sampling a pixel at this relative error, 0 disables adaptive sampling
+  size_t min_samples = 16; // samples taken before the error is checked the first time
+};
+
+struct ProgressiveSettings
+{
+  size_t pass_samples = 0;       // samples per pixel and pass, 0 renders everything in one pass
+  float snapshot_interval = 0.0; // minimum seconds between two snapshots
+  float time_budget = 0.0;       // seconds from start to finished image, 0 renders a fixed sample count
+  char const * checkpoint = nullptr; // written with every snapshot and after the last pass
+  char const * resume = nullptr;     // checkpoint to continue from
+};
+
+struct DenoiseSettings
+{
+  size_t iterations = 0;       // filter passes, each doubling the radius; 0 disables denoising
+  float sigma_color = 0.5;     // in standard errors of the pixel
+  float min_variance = 1e-4;   // of the irradiance, below it colors are compared as if this noisy
+  float sigma_albedo = 0.1;
+  float sigma_normal = 0.05;
+  float sigma_depth = 0.01;    // relative to the depth, per pixel of tap spacing
+  bool benchmark = false;      // compare denoised low sample counts against --spp instead of rendering
+};
+
+enum class ToneMap
+{
+  exposure,
+  reinhard,
+  aces,
+};
+
+struct PostSettings
+{
+  ToneMap tone_map = ToneMap::exposure;
+  float exposure = 1.0; // linear values are scaled by this before tone mapping
+  float gamma = 2.2;
+};
+
+enum class VideoFormat
+{
+  y4m, // YUV4MPEG2 with 4:2:0 chroma, readable by most encoders
+  rgb, // raw 8 bit rgb frames, one after the other
+};
+
+// Renders `frames` images with the camera moving on a circle around the
+// center of the scene, `orbit` degrees in total, and streams them as video.
+struct SequenceSettings
+{
+  size_t frames = 0; // 0 renders a single image
+  float orbit = 360.0;
+  float orbit_radius = 7.0; // keeps the camera inside the cornell box
+  uint32_t fps = 30;
+  VideoFormat format = VideoFormat::y4m;
+  char const * output = "-"; // "-" is stdout
+};
+
+struct RenderStats
+{
+  double render_time; // seconds
+  size_t samples;     // samples traced over all pixels
+  size_t passes;
+};
+
+struct RenderSettings
+{
+  size_t width = 512;
+  size_t height = 512;
+  size_t super_sampling = 64;
+  size_t tile_size = 32;
+  size_t threads = 0; // 0 means "one per hardware thread"
+  uint32_t seed = 0;
+  uint32_t frame = 0;
+  size_t extra_spheres = 0;
+  bool stats = false; // print statistics to stderr
+  TraceMode mode = TraceMode::single;
+  SamplerType sampler = SamplerType::sobol;
+  bool sort_rays = false; // sort wavefront queues by material and direction
+  BvhSettings bvh;
+  TraceSettings trace;
+  AdaptiveSettings adaptive;
+  ProgressiveSettings progressive;
+  DenoiseSettings denoise;
+  PostSettings post;
+  SequenceSettings sequence;
+  char const * output = "output.pgm";
+  char const * aov_output = nullptr; // exr file for the linear image and the feature buffers
+  char const * framebuffer = nullptr; // file backing the accumulation buffers, for images larger than memory
+  char const * shared_memory = nullptr; // name of a shared memory object holding the accumulation buffers
+
+  size_t threadCount() const
+  {
+    if(threads > 0)
+      return threads;
+    return std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+};
+
+struct Renderer
+{
+  Scene const & scene;
+  Camera const & camera;
+  RenderSettings const & settings;
+  Sampler const & sampler;
+
+  // Every sample draws from its own counter based stream, so the result does
+  // not depend on which thread renders the pixel or in which order.
+  // What the sampler derives from the pixel alone is computed once per pixel.
+  struct PixelRng
+  {
+    Renderer const & renderer;
+    size_t x, y;
+    uint64_t pixel;
+    Philox::Counter seeds;
+
+    SampleRng operator()(size_t sample) const
+    {
+      SampleRng rng { renderer.settings.seed, renderer.settings.frame, pixel, uint32_t(sample) };
+      std::visit([&](auto const & s) { s.start(rng, x, y, seeds, uint32_t(sample)); }, renderer.sampler);
+      return rng;
+    }
+  };
+
+  PixelRng pixelRng(size_t x, size_t y) const
+  {
+    uint64_t pixel = uint64_t(y) * settings.width + x;
+    Philox::Counter seeds = std::visit([&](auto const & s) { return s.pixelSeeds(pixel); }, sampler);
+    return PixelRng { *this, x, y, pixel, seeds };
+  }
+
+  // `center_offset` is set to the squared distance from the pixel center, in pixels
+  Vec3 primaryRay(size_t x, size_t y, SampleRng & rng, float & center_offset) const
+  {
+    float dx = rng.next() - 0.5f;
+    float dy = rng.next() - 0.5f;
+    center_offset = dx * dx + dy * dy;
+
+    float ss_x = 2.0 * float(x + dx) / float(settings.width - 1) - 1.0;
+    float ss_y = 1.0 - 2.0 * float(y + dy) / float(settings.height - 1);
+
+    return camera.projectRay(ss_x, ss_y);
+  }
+
+  // Adds a sample whose primary ray hit `primary`, or nothing, to `features`.
+  static void addFeatures(FeatureBuffers & features, size_t pixel, float center_offset, std::optional<Intersection> const & primary)
+  {
+    if(primary == std::nullopt) {
+      features.add(pixel, center_offset, 0, Color { 0.0 }, Vec3 { 0, 0, 0 }, 0.0f);
+      return;
+    }
+    Material const & material = *primary->material;
+    features.add(pixel, center_offset, primary->object + 1, material.albedo + Color { material.reflectivity }, primary->normal, primary->distance);
+  }
+
+  // Traces the samples [first, first + count) of a pixel and calls `visit(color)`
+  // for each of them in order. Samples that hit nothing are black.
+  // The primary hits go to `features` unless it is null.
+  template<typename F>
+  void samplePixel(size_t x, size_t y, size_t first, size_t count, FeatureBuffers * features, F const & visit) const
+  {
+    PixelRng const sampleRng = pixelRng(x, y);
+    size_t const pixel = y * settings.width + x;
+    if(settings.mode == TraceMode::packets)
+    {
+      for(size_t begin = first; begin < first + count; begin += RayPacket::size)
+      {
+        size_t const lanes = std::min(RayPacket::size, first + count - begin);
+
+        RayPacket rays;
+        SampleRng rngs[RayPacket::size];
+        float center_offsets[RayPacket::size];
+        for(size_t lane = 0; lane < lanes; lane++) {
+          rngs[lane] = sampleRng(begin + lane);
+          rays.set(lane, camera.position, primaryRay(x, y, rngs[lane], center_offsets[lane]), std::numeric_limits<float>::max());
+        }
+
+        Color colors[RayPacket::size];
+        std::optional<Intersection> primaries[RayPacket::size];
+        uint32_t mask = scene.trace(rays, colors, primaries, settings.trace, rngs);
+        for(size_t lane = 0; lane < lanes; lane++) {
+          if(features != nullptr)
+            addFeatures(*features, pixel, center_offsets[lane], primaries[lane]);
+          visit((mask & (1u << lane)) ? colors[lane] : Color { 0.0 });
+        }
+      }
+    }
+    else
+    {
+      for(size_t i = first; i < first + count; i++)
+      {
+        SampleRng rng = sampleRng(i);
+        float center_offset;
+        Vec3 ray_direction = primaryRay(x, y, rng, center_offset);
+        std::optional<Intersection> primary = scene.intersect(camera.position, ray_direction);
+        if(features != nullptr)
+          addFeatures(*features, pixel, center_offset, primary);
+        visit(primary ? scene.trace(*primary, ray_direction, settings.trace, rng) : Color { 0.0 });
+      }
+    }
+  }
+
+  // Adds `count` more samples to the sums of a pixel and returns the number of
+  // samples taken, which may be less with adaptive sampling.
+  size_t renderPixel(size_t x, size_t y, size_t first, size_t count, Color & sum, Color & sum_squares, FeatureBuffers * features) const
+  {
+    if(settings.adaptive.threshold <= 0.0f)
+    {
+      samplePixel(x, y, first, count, features, [&](Color c) {
+        sum += c;
+        sum_squares += c * c;
+      });
+      return count;
+    }
+
+    // take samples in batches until the estimated error is small enough
+    size_t const batch = (settings.mode == TraceMode::packets) ? RayPacket::size : 1;
+    size_t const min_samples = std::min(settings.adaptive.min_samples, count);
+
+    // a resumed pixel may have converged already
+    if(first >= settings.adaptive.min_samples && PixelEstimate::converged(sum, sum_squares, first, settings.adaptive.threshold))
+      return 0;
+
+    PixelEstimate estimate;
+    estimate.sum = sum;
+    while(estimate.count < count)
+    {
+      size_t n = std::max(batch, min_samples - std::min(min_samples, estimate.count));
+      n = std::min(n, count - estimate.count);
+      samplePixel(x, y, first + estimate.count, n, features, [&](Color c) {
+        estimate.add(c);
+        sum_squares += c * c;
+      });
+
+      if(estimate.count >= min_samples && estimate.converged(settings.adaptive.threshold))
+        break;
+    }
+    sum = estimate.sum;
+    return estimate.count;
+  }
+
+  std::vector<Tile> tiles() const
+  {
+    size_t const size = std::max<size_t>(1, settings.tile_size);
+
+    std::vector<Tile> result;
+    for(size_t y = 0; y < settings.height; y += size)
+    {
+      for(size_t x = 0; x < settings.width; x += size)
+      {
+        result.push_back(Tile {
+          x, y,
+          std::min(size, settings.width - x),
+          std::min(size, settings.height - y),
+        });
+      }
+    }
+    return result;
+  }
+
+  // Adds `count` samples to every pixel of the tile, returns the number of samples taken
+  size_t renderTile(Accumulator & target, Tile const & tile, size_t count) const
+  {
+    size_t total = 0;
+    for(size_t y = tile.y; y < tile.y + tile.height; y++)
+    {
+      for(size_t x = tile.x; x < tile.x + tile.width; x++)
+      {
+        size_t const i = y * target.width + x;
+        // adaptive pixels stop at different counts, a resumed render only
+        // tops each of them up to the maximum
+        size_t pixel_count = count;
+        if(settings.adaptive.threshold > 0.0f)
+          pixel_count = std::min(count, settings.super_sampling - std::min<size_t>(settings.super_sampling, target.samples[i]));
+        size_t samples = renderPixel(x, y, target.samples[i], pixel_count, target.sum[i], target.sum_squares[i], target.features ? &*target.features : nullptr);
+        target.samples[i] += uint32_t(samples);
+        total += samples;
+      }
+    }
+    return total;
+  }
+
+  // Renders a tile stage by stage: all camera rays of a wave are generated,
+  // intersected, shadow tested and shaded in turn, then the reflected rays
+  // form the next bounce until no path is left. Every wave takes as many
+  // samples of all pixels as fit in Wavefront::max_paths, so the memory
+  // of a worker doesn't grow with the sample count.
+  size_t renderTile(Accumulator & target, Tile const & tile, size_t count, Wavefront & wave) const
+  {
+    size_t const wave_samples = std::max<size_t>(1, Wavefront::max_paths / (tile.width * tile.height));
+    size_t paths = 0;
+    for(size_t done = 0; done < count; done += wave_samples)
+      paths += renderWave(target, tile, std::min(wave_samples, count - done), wave);
+    return paths;
+  }
+
+  // Adds `spp` samples to every pixel of the tile in one wave.
+  size_t renderWave(Accumulator & target, Tile const & tile, size_t spp, Wavefront & wave) const
+  {
+    size_t const paths = tile.width * tile.height * spp;
+
+    wave.radiance.assign(paths, Color { 0.0 });
+    wave.throughput.assign(paths, Color { 1.0 });
+    wave.hit_anything.assign(paths, 0);
+    wave.rng.resize(paths);
+    wave.center_offset.resize(paths);
+
+    // ray generation
+    wave.rays.clear();
+    for(size_t y = 0; y < tile.height; y++)
+    {
+      for(size_t x = 0; x < tile.width; x++)
+      {
+        PixelRng const sampleRng = pixelRng(tile.x + x, tile.y + y);
+        size_t const first = target.samples[(tile.y + y) * target.width + tile.x + x];
+        for(size_t i = 0; i < spp; i++)
+        {
+          size_t path = (y * tile.width + x) * spp + i;
+          wave.rng[path] = sampleRng(first + i);
+          Vec3 direction = primaryRay(tile.x + x, tile.y + y, wave.rng[path], wave.center_offset[path]);
+          wave.rays.push(camera.position, direction, std::numeric_limits<float>::max(), uint32_t(path));
+        }
+      }
+    }
+
+    for(size_t depth = 0; wave.rays.size() > 0; depth++)
+    {
+      if(settings.sort_rays)
+        wave.rays.sortByDirection();
+
+      // closest hit
+      wave.rays.closestHit(scene);
+
+      // the camera rays are the only ones whose hits go to the feature buffers
+      FeatureBuffers * const features = (depth == 0 && target.features) ? &*target.features : nullptr;
+      auto pixelOf = [&](uint32_t path) {
+        size_t const local = path / spp;
+        return (tile.y + local / tile.width) * target.width + tile.x + local % tile.width;
+      };
+
+      wave.hits.clear();
+      for(size_t i = 0; i < wave.rays.size(); i++)
+      {
+        uint32_t const path = wave.rays.owner[i];
+        if(wave.rays.distance[i] == std::numeric_limits<float>::max()) {
+          if(features != nullptr)
+            addFeatures(*features, pixelOf(path), wave.center_offset[path], std::nullopt);
+          continue;
+        }
+        wave.hits.path.push_back(path);
+        wave.hits.incoming.push_back(wave.rays.direction(i));
+        wave.hits.surface.push_back(scene.surface(wave.rays.origin(i), wave.rays.direction(i), Hit { wave.rays.distance[i], wave.rays.object[i] }));
+        wave.hits.lighting.push_back(Scene::ambientLighting());
+        if(features != nullptr)
+          addFeatures(*features, pixelOf(path), wave.center_offset[path], wave.hits.surface.back());
+      }
+
+      if(settings.sort_rays)
+        sortByMaterial(wave.hits, wave.sorted_hits);
+
+      // shadow rays
+      wave.shadow_rays.clear();
+      wave.shadow_lights.clear();
+      wave.shadows.clear();
+      for(size_t h = 0; h < wave.hits.path.size(); h++)
+      {
+        if(!Scene::receivesLight(wave.hits.surface[h]))
+          continue;
+        for(size_t l = 0; l < scene.lights.size(); l++)
+        {
+          Scene::ShadowRay shadow = Scene::shadowRay(scene.lights[l], wave.hits.surface[h].position);
+          wave.shadow_rays.push(scene.lights[l].position, shadow.direction, shadow.distance - 1e-3f, uint32_t(h)); // needs tiny delta due to imprecision
+          wave.shadow_lights.push_back(uint32_t(l));
+          wave.shadows.push_back(shadow);
+        }
+      }
+
+      wave.shadow_rays.occluded(scene);
+
+      for(size_t i = 0; i < wave.shadow_rays.size(); i++)
+      {
+        if(wave.shadow_rays.distance[i] == 0.0f)
+          continue; // ray to light is obstructed
+        uint32_t h = wave.shadow_rays.owner[i];
+        PointLight const & light = scene.lights[wave.shadow_lights[i]];
+        wave.hits.lighting[h] += Scene::illumination(light, wave.shadows[i], wave.hits.surface[h].normal);
+      }
+
+      // shading
+      wave.next_rays.clear();
+      for(size_t h = 0; h < wave.hits.path.size(); h++)
+      {
+        uint32_t path = wave.hits.path[h];
+        Intersection const & surface = wave.hits.surface[h];
+
+        wave.radiance[path] += wave.throughput[path] * Scene::shade(surface, wave.hits.lighting[h]);
+        wave.hit_anything[path] = 1;
+
+        if(Scene::reflects(surface, depth, wave.throughput[path], settings.trace, wave.rng[path]))
+        {
+          Vec3 refl_dir = wave.hits.incoming[h].reflect(surface.normal);
+          Vec3 refl_origin = surface.position + refl_dir * 1e-4;
+          wave.next_rays.push(refl_origin, refl_dir, std::numeric_limits<float>::max(), path);
+        }
+      }
+      std::swap(wave.rays, wave.next_rays);
+    }
+
+    for(size_t y = 0; y < tile.height; y++)
+    {
+      for(size_t x = 0; x < tile.width; x++)
+      {
+        size_t const pixel = (tile.y + y) * target.width + tile.x + x;
+        for(size_t i = 0; i < spp; i++)
+        {
+          size_t path = (y * tile.width + x) * spp + i;
+          if(wave.hit_anything[path]) {
+            target.sum[pixel] += wave.radiance[path];
+            target.sum_squares[pixel] += wave.radiance[path] * wave.radiance[path];
+          }
+        }
+        target.samples[pixel] += uint32_t(spp);
+      }
+    }
+    return paths;
+  }
+
+  // Groups the hits by material, so shading runs over one material at a time.
+  static void sortByMaterial(Wavefront::Hits & hits, Wavefront::Hits & scratch)
+  {
+    std::vector<uint32_t> order(hits.path.size());
+    for(size_t i = 0; i < order.size(); i++) {
+      order[i] = uint32_t(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return std::less<Material const *>()(hits.surface[a].material, hits.surface[b].material);
+    });
+
+    scratch.clear();
+    for(uint32_t i : order)
+    {
+      scratch.path.push_back(hits.path[i]);
+      scratch.incoming.push_back(hits.incoming[i]);
+      scratch.surface.push_back(hits.surface[i]);
+      scratch.lighting.push_back(hits.lighting[i]);
+    }
+    std::swap(hits, scratch);
+  }
+
+  // Adds `count` samples to every pixel. Calls `finished(begin, end)` from
+  // the render threads as soon as all tiles of the rows [begin, end) are done.
+  // Tiles never overlap, so workers can write into `target` without locking.
+  template<typename F>
+  RenderStats renderPass(Accumulator & target, size_t count, F const & finished) const
+  {
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<Tile> const work = tiles();
+    std::atomic<size_t> samples { 0 };
+
+    // tiles() is row major, so every band of rows is a run of tiles
+    size_t const size = std::max<size_t>(1, settings.tile_size);
+    size_t const tiles_per_band = (settings.width + size - 1) / size;
+    std::vector<std::atomic<size_t>> remaining((settings.height + size - 1) / size);
+    for(auto & band : remaining)
+      band = tiles_per_band;
+
+    WorkStealingPool pool { settings.threadCount() };
+    std::vector<Wavefront> waves(settings.mode == TraceMode::wavefront ? pool.thread_count : 0);
+    auto job = [&](size_t index, size_t worker) {
+      Tile const & tile = work[index];
+      if(settings.mode == TraceMode::wavefront)
+        samples += renderTile(target, tile, count, waves[worker]);
+      else
+        samples += renderTile(target, tile, count);
+
+      if(--remaining[tile.y / size] == 0)
+        finished(tile.y, tile.y + tile.height);
+    };
+
+    if(settings.framebuffer == nullptr) {
+      pool.run(work.size(), job);
+    } else {
+      // Out of core, one band at a time: only its rows are paged in and
+      // they leave memory again before the next band starts.
+      for(size_t band = 0; band < remaining.size(); band++)
+      {
+        pool.run(tiles_per_band, [&](size_t index, size_t worker) {
+          job(band * tiles_per_band + index, worker);
+        });
+        target.release(band * size, std::min(settings.height, (band + 1) * size));
+      }
+    }
+
+    return RenderStats {
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+      samples.load(),
+      1,
+    };
+  }
+
+  // Renders up to `settings.super_sampling` samples per pixel in passes of
+  // `settings.progressive.pass_samples` and calls `snapshot(target)` between
+  // passes, at most once per `settings.progressive.snapshot_interval`.
+  // With a `deadline`, passes are added until the next one would not finish
+  // in time instead, but at least one pass is always rendered.
+  // Snapshots are only taken if a pass size was requested explicitly.
+  // `finished(begin, end)` is called exactly once for all rows, as soon as
+  // they are final: during the last pass from the render threads, or at the
+  // end if the last pass isn't known in advance.
+  template<typename F, typename G>
+  RenderStats render(Accumulator & target, F const & snapshot, G const & finished, std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt) const
+  {
+    bool const snapshots = (settings.progressive.pass_samples > 0);
+    size_t pass_samples = settings.progressive.pass_samples;
+    if(pass_samples == 0)
+      pass_samples = deadline ? 1 : settings.super_sampling;
+    size_t const total = deadline ? std::numeric_limits<size_t>::max() : settings.super_sampling;
+
+    RenderStats stats { 0.0, 0, 0 };
+    auto last_snapshot = std::chrono::steady_clock::now();
+
+    bool streamed = false;
+    auto pending = [](size_t, size_t) { };
+
+    // a resumed render continues after the samples it already has
+    for(size_t done = target.minSamples(); done < total; )
+    {
+      size_t count = std::min(pass_samples, total - done);
+      bool const last = (done + count == total);
+      RenderStats pass = last ? renderPass(target, count, finished) : renderPass(target, count, pending);
+      streamed = streamed || last;
+      stats.render_time += pass.render_time;
+      stats.samples += pass.samples;
+      stats.passes += 1;
+      done += count;
+
+      auto now = std::chrono::steady_clock::now();
+      if(deadline) {
+        // assume the next pass takes as long as this one
+        auto pass_time = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(pass.render_time));
+        if(now + pass_time > *deadline)
+          break;
+      }
+
+      if(snapshots && done < total && std::chrono::duration<double>(now - last_snapshot).count() >= settings.progressive.snapshot_interval) {
+        snapshot(target);
+        last_snapshot = now;
+      }
+    }
+
+    if(!streamed) {
+      // in parallel, so encoding the output isn't serial, except out of core
+      size_t const band = std::max<size_t>(1, settings.tile_size);
+      WorkStealingPool pool { (settings.framebuffer != nullptr) ? 1 : settings.threadCount() };
+      pool.run((settings.height + band - 1) / band, [&](size_t index, size_t) {
+        finished(index * band, std::min(settings.height, (index + 1) * band));
+      });
+    }
+    return stats;
+  }
+};
+
+// Edge avoiding à-trous wavelet filter. Every iteration blurs with a 5x5
+// B3 spline kernel whose taps are twice as far apart as in the previous one,
+// weighted down across edges in albedo, normal and depth, and across color
+// differences that are large compared to the noise around the filtered
+// pixel. As in SVGF, that noise is the variance of the pixel means blurred
+// over 3x3 pixels with a floor under it, and is carried through every
+// iteration with the squared filter weights.
+// Filters the irradiance (color divided by albedo), so material edges stay sharp.
+//
+// This removes sampling noise in smooth regions. It can't tell where inside
+// a pixel an edge of a shadow or a reflection lies, so it doesn't replace
+// samples where aliasing is the noise, as everywhere in the built in scene:
+// --denoise-benchmark shows denoised 4 and 8 spp barely ahead of plain ones.
+// Pixels whose samples agree to within the noise floor are left as they are.
+// see: https://jo.dreggn.org/home/2010_atrous.pdf
+// and: https://research.nvidia.com/publication/2017-07_spatiotemporal-variance-guided-filtering-real-time-reconstruction-path-traced
+struct Denoiser
+{
+  using L = SimdLanes;
+
+  DenoiseSettings const & settings;
+  size_t threads;
+
+  // A padded float image per channel. Padding replicates the border pixels,
+  // so the kernel never needs bounds checks and every row can be processed in
+  // full SIMD vectors.
+  struct Planes
+  {
+    size_t width, height, pad, stride;
+    std::vector<float> data;
+
+    Planes(size_t width, size_t height, size_t pad, size_t channels) :
+      width(width), height(height), pad(pad),
+      stride(pad + (width + L::width - 1) / L::width * L::width + pad),
+      data(channels * stride * (height + 2 * pad), 0.0f)
+    {
+
+    }
+
+    float * channel(size_t c) {
+      return data.data() + c * stride * (height + 2 * pad);
+    }
+
+    float const * channel(size_t c) const {
+      return data.data() + c * stride * (height + 2 * pad);
+    }
+
+    // index of the pixel (x, y) inside a channel
+    size_t index(size_t x, size_t y) const {
+      return (y + pad) * stride + x + pad;
+    }
+
+    void fillPadding(size_t c)
+    {
+      float * p = channel(c);
+      size_t const rows = height + 2 * pad;
+      for(size_t y = 0; y < rows; y++)
+      {
+        size_t const src_y = std::min(std::max(y, pad), pad + height - 1);
+        float * row = p + y * stride;
+        float const * src = p + src_y * stride;
+        for(size_t x = 0; x < stride; x++) {
+          size_t const src_x = std::min(std::max(x, pad), pad + width - 1);
+          if(y != src_y || x != src_x)
+            row[x] = src[src_x];
+        }
+      }
+    }
+  };
+
+  static float demodulation(float albedo) {
+    return (albedo > 1e-3f) ? albedo : 1.0f;
+  }
+
+  static float squared(float v) {
+    return v * v;
+  }
+
+  // of the color divided by `albedo`, summed over the channels
+  static float irradianceVariance(Color variance, Color albedo) {
+    return variance.r / squared(demodulation(albedo.r)) + variance.g / squared(demodulation(albedo.g)) + variance.b / squared(demodulation(albedo.b));
+  }
+
+  // `variance` is the variance of every pixel's mean, see Accumulator::variance()
+  void apply(Image & image, FeatureBuffers const & features, std::vector<Color> const & variance) const
+  {
+    if(settings.iterations == 0)
+      return;
+
+    size_t const width = image.width, height = image.height;
+    size_t const pad = size_t(2) << (settings.iterations - 1);
+
+    // channels: albedo rgb, normal xyz, depth
+    Planes guide { width, height, pad, 7 };
+    Planes color[2] = { { width, height, pad, 3 }, { width, height, pad, 3 } };
+    Planes noise[2] = { { width, height, pad, 1 }, { width, height, pad, 1 } }; // variance of the irradiance
+    Planes smoothed_noise { width, height, pad, 1 };
+    for(size_t y = 0; y < height; y++)
+    {
+      for(size_t x = 0; x < width; x++)
+      {
+        size_t const i = y * width + x;
+        size_t const p = guide.index(x, y);
+        Color const a = features.albedo[i];
+        Vec3 const n = features.normal[i];
+        float const values[7] = { a.r, a.g, a.b, n.x, n.y, n.z, features.depth[i] };
+        for(size_t c = 0; c < 7; c++)
+          guide.channel(c)[p] = values[c];
+
+        Color const c = image.pixels[i];
+        color[0].channel(0)[p] = c.r / demodulation(a.r);
+        color[0].channel(1)[p] = c.g / demodulation(a.g);
+        color[0].channel(2)[p] = c.b / demodulation(a.b);
+
+        noise[0].channel(0)[p] = irradianceVariance(variance[i], a);
+      }
+    }
+    for(size_t c = 0; c < 7; c++)
+      guide.fillPadding(c);
+
+    WorkStealingPool pool { threads };
+    size_t const band = 8;
+    size_t const bands = (height + band - 1) / band;
+
+    for(size_t iteration = 0; iteration < settings.iterations; iteration++)
+    {
+      Planes const & source = color[iteration % 2];
+      Planes & target = color[(iteration + 1) % 2];
+      Planes const & source_noise = noise[iteration % 2];
+      Planes & target_noise = noise[(iteration + 1) % 2];
+      for(size_t c = 0; c < 3; c++)
+        color[iteration % 2].fillPadding(c);
+      noise[iteration % 2].fillPadding(0);
+
+      // A pixel whose few samples happen to agree has a variance of zero,
+      // though its neighbours show that it is just as uncertain. A 3x3
+      // gaussian spreads the estimate, as in SVGF.
+      pool.run(bands, [&](size_t index, size_t) {
+        for(size_t y = index * band; y < std::min(height, (index + 1) * band); y++)
+          blurRow(source_noise, smoothed_noise, y);
+      });
+      smoothed_noise.fillPadding(0);
+
+      size_t const step = size_t(1) << iteration;
+      pool.run(bands, [&](size_t index, size_t) {
+        for(size_t y = index * band; y < std::min(height, (index + 1) * band); y++)
+          filterRow(source, source_noise, smoothed_noise, guide, target, target_noise, y, step);
+      });
+    }
+
+    // Pixels whose noise is already below the floor keep their own mean,
+    // neighbours can only make them worse.
+    Planes const & result = color[settings.iterations % 2];
+    for(size_t y = 0; y < height; y++)
+    {
+      for(size_t x = 0; x < width; x++)
+      {
+        size_t const i = y * width + x;
+        size_t const p = result.index(x, y);
+        Color const a = features.albedo[i];
+        if(irradianceVariance(variance[i], a) <= settings.min_variance)
+          continue;
+        image.pixels[i] = Color {
+          result.channel(0)[p] * demodulation(a.r),
+          result.channel(1)[p] * demodulation(a.g),
+          result.channel(2)[p] * demodulation(a.b),
+        };
+      }
+    }
+  }
+
+  // 3x3 binomial blur of a single channel
+  static void blurRow(Planes const & source, Planes & target, size_t y)
+  {
+    float const * in = source.channel(0);
+    float * out = target.channel(0);
+    ptrdiff_t const stride = ptrdiff_t(source.stride);
+    for(size_t x = 0; x < source.width; x += L::width)
+    {
+      size_t const p = source.index(x, y);
+      auto row = [&](ptrdiff_t offset) {
+        float const * r = in + p + offset;
+        return L::add(L::add(L::load(r - 1), L::load(r + 1)), L::mul(L::set(2.0f), L::load(r)));
+      };
+      L::F const sum = L::add(L::add(row(-stride), row(stride)), L::mul(L::set(2.0f), row(0)));
+      L::store(out + p, L::mul(sum, L::set(1.0f / 16.0f)));
+    }
+  }
+
+  // Filters one row of `source` into `target`. `smoothed_noise` sets the
+  // color tolerance, the variance in `noise` is carried through the filter
+  // into `target_noise` for the next iteration.
+  void filterRow(Planes const & source, Planes const & noise, Planes const & smoothed_noise, Planes const & guide, Planes & target, Planes & target_noise, size_t y, size_t step) const
+  {
+    static constexpr float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+    float const * c_in[3] = { source.channel(0), source.channel(1), source.channel(2) };
+    float * c_out[3] = { target.channel(0), target.channel(1), target.channel(2) };
+    float const * v_in = noise.channel(0);
+    float * v_out = target_noise.channel(0);
+    float const * g[7];
+    for(size_t c = 0; c < 7; c++)
+      g[c] = guide.channel(c);
+
+    L::F const zero = L::set(0.0f);
+    L::F const one = L::set(1.0f);
+    L::F const color_scale = L::set(settings.sigma_color * settings.sigma_color);
+    L::F const min_variance = L::set(settings.min_variance);
+    L::F const inv_albedo = L::set(1.0f / (settings.sigma_albedo * settings.sigma_albedo));
+    L::F const inv_normal = L::set(1.0f / (settings.sigma_normal * settings.sigma_normal));
+    L::F const depth_scale = L::set(settings.sigma_depth * float(step));
+    L::F const depth_epsilon = L::set(1e-6f);
+
+    auto square = [](L::F v) { return L::mul(v, v); };
+    auto distance2 = [&](float const * const * planes, size_t q, L::F const (&center)[3]) {
+      L::F d = square(L::sub(L::load(planes[0] + q), center[0]));
+      d = L::add(d, square(L::sub(L::load(planes[1] + q), center[1])));
+      return L::add(d, square(L::sub(L::load(planes[2] + q), center[2])));
+    };
+
+    for(size_t x = 0; x < source.width; x += L::width)
+    {
+      size_t const p = source.index(x, y);
+
+      L::F const color[3] = { L::load(c_in[0] + p), L::load(c_in[1] + p), L::load(c_in[2] + p) };
+      L::F const albedo[3] = { L::load(g[0] + p), L::load(g[1] + p), L::load(g[2] + p) };
+      L::F const normal[3] = { L::load(g[3] + p), L::load(g[4] + p), L::load(g[5] + p) };
+      L::F const depth = L::load(g[6] + p);
+
+      // the floor keeps converged pixels from rejecting every neighbour
+      L::F const inv_noise = L::div(one, L::mul(L::max(L::load(smoothed_noise.channel(0) + p), min_variance), color_scale));
+      // depth differences are relative to the distance and the tap spacing
+      L::F const inv_depth = L::div(one, L::add(square(L::mul(depth, depth_scale)), depth_epsilon));
+
+      L::F sum[3] = { zero, zero, zero };
+      L::F variance_sum = zero;
+      L::F weight_sum = zero;
+      for(int dy = -2; dy <= 2; dy++)
+      {
+        for(int dx = -2; dx <= 2; dx++)
+        {
+          size_t const q = p + (ptrdiff_t(dy) * ptrdiff_t(source.stride) + dx) * ptrdiff_t(step);
+
+          L::F e = L::mul(distance2(c_in, q, color), inv_noise);
+          e = L::add(e, L::mul(distance2(g, q, albedo), inv_albedo));
+          e = L::add(e, L::mul(distance2(g + 3, q, normal), inv_normal));
+          e = L::add(e, L::mul(square(L::sub(L::load(g[6] + q), depth)), inv_depth));
+
+          // rational falloff instead of exp(-e), cheap enough for every lane
+          L::F const r = L::div(one, L::add(one, e));
+          L::F const w = L::mul(L::set(kernel[std::abs(dx)] * kernel[std::abs(dy)]), L::mul(r, r));
+
+          weight_sum = L::add(weight_sum, w);
+          for(size_t c = 0; c < 3; c++)
+            sum[c] = L::add(sum[c], L::mul(w, L::load(c_in[c] + q)));
+          variance_sum = L::add(variance_sum, L::mul(square(w), L::load(v_in + q)));
+        }
+      }
+
+      // the center tap always has a positive weight
+      L::F const inv_weight = L::div(one, weight_sum);
+      for(size_t c = 0; c < 3; c++)
+        L::store(c_out[c] + p, L::mul(sum[c], inv_weight));
+      L::store(v_out + p, L::mul(variance_sum, square(inv_weight)));
+    }
+  }
+};
+
+// Tone mapping, gamma correction and quantization to 8 bits in one step.
+// All three are monotonic per channel, so the 8 bit code of a linear value
+// is the number of thresholds it reaches. The thresholds are computed once
+// by inverting the curves, a table indexed by the leading bits of the float
+// finds the code below it and a single compare corrects it, so no exp or pow
+// is evaluated per pixel.
+// see: https://learnopengl.com/Advanced-Lighting/HDR
+struct PostProcess
+{
+  // float mantissa bits kept in a table index, enough to never have two
+  // thresholds in the same table entry
+  static constexpr uint32_t index_bits = 11;
+  static constexpr uint32_t shift = 23 - index_bits;
+
+  std::array<float, 257> thresholds; // [k] is the smallest linear value mapped to code k or higher
+  std::vector<uint8_t> table;
+  uint32_t first_key, last_key;
+
+  explicit PostProcess(PostSettings const & settings)
+  {
+    thresholds[0] = 0.0f;
+    thresholds[256] = std::numeric_limits<float>::infinity();
+    float largest = 0.0f;
+    for(size_t k = 1; k < 256; k++)
+    {
+      double display = std::pow(double(k) / 255.0, double(settings.gamma));
+      double linear = inverseToneMap(settings.tone_map, display) / double(settings.exposure);
+      float threshold = float(linear);
+      if(double(threshold) < linear)
+        threshold = std::nextafter(threshold, std::numeric_limits<float>::infinity());
+      thresholds[k] = threshold;
+      if(std::isfinite(threshold))
+        largest = threshold;
+    }
+
+    first_key = (bits(thresholds[1]) >> shift) - 1;
+    last_key = (bits(largest) >> shift) + 1;
+    table.resize(last_key - first_key + 1);
+    uint8_t code = 0;
+    for(uint32_t key = first_key; key <= last_key; key++)
+    {
+      float lower;
+      uint32_t lower_bits = key << shift;
+      memcpy(&lower, &lower_bits, sizeof lower);
+      while(code < 255 && lower >= thresholds[code + 1])
+        code++;
+      table[key - first_key] = code;
+    }
+  }
+
+  static uint32_t bits(float v)
+  {
+    uint32_t result;
+    memcpy(&result, &v, sizeof result);
+    return result;
+  }
+
+  // the linear value a tone map turns into `display`, which is in [0, 1]
+  static double inverseToneMap(ToneMap tone_map, double display)
+  {
+    // exposure and reinhard only approach 1, but reach it in float precision
+    double const saturated = std::min(display, 1.0 - 0x1.0p-24);
+    switch(tone_map)
+    {
+      case ToneMap::exposure: // 1 - exp(-x)
+        return -std::log(1.0 - saturated);
+
+      case ToneMap::reinhard: // x / (x + 1)
+        return saturated / (1.0 - saturated);
+
+      case ToneMap::aces:
+      {
+        // https://knarkowicz.wordpress.com/2016/01/06/aces-filmic-tone-mapping-curve/
+        // x (a x + b) / (x (c x + d) + e), solved for x
+        double const a = 2.51, b = 0.03, c = 2.43, d = 0.59, e = 0.14;
+        double qa = a - display * c, qb = b - display * d, qc = -display * e;
+        return (-qb + std::sqrt(qb * qb - 4.0 * qa * qc)) / (2.0 * qa);
+      }
+    }
+    return 0.0;
+  }
+
+  uint8_t quantize(float linear) const
+  {
+    if(!(linear > 0.0f)) // also catches NaN
+      return 0;
+    uint32_t key = std::min(std::max(bits(linear) >> shift, first_key), last_key);
+    uint8_t code = table[key - first_key];
+    // thresholds[256] is infinite, so only codes below 255 can step up
+    return uint8_t(code + (code < 255 && linear >= thresholds[code + 1]));
+  }
+
+  // converts `count` pixels to rgb bytes
+  void apply(Color const * pixels, uint8_t * rgb, size_t count) const
+  {
+    for(size_t i = 0; i < count; i++)
+    {
+      rgb[3 * i + 0] = quantize(pixels[i].r);
+      rgb[3 * i + 1] = quantize(pixels[i].g);
+      rgb[3 * i + 2] = quantize(pixels[i].b);
+    }
+  }
+
+  // converts a whole image in bands of rows on `threads` threads
+  std::vector<uint8_t> apply(Image const & image, size_t threads) const
+  {
+    std::vector<uint8_t> rgb(3 * image.width * image.height);
+    size_t const band = 16;
+    size_t const bands = (image.height + band - 1) / band;
+    WorkStealingPool pool { std::min(threads, std::max<size_t>(1, bands)) };
+    pool.run(bands, [&](size_t index, size_t) {
+      size_t const begin = index * band * image.width;
+      size_t const end = std::min(image.height, (index + 1) * band) * image.width;
+      apply(image.pixels.data() + begin, rgb.data() + 3 * begin, end - begin);
+    });
+    return rgb;
+  }
+};
+
+// CRC-32 as used by PNG chunks
+// see: https://www.w3.org/TR/png/#D-CRCAppendix
+struct Crc32
+{
+  std::array<uint32_t, 256> table;
+
+  Crc32()
+  {
+    for(uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t c = n;
+      for(size_t k = 0; k < 8; k++)
+        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+      table[n] = c;
+    }
+  }
+
+  // continues `crc` over `size` more bytes, start with 0
+  uint32_t update(uint32_t crc, uint8_t const * data, size_t size) const
+  {
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++)
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  static Crc32 const & instance()
+  {
+    static Crc32 const crc;
+    return crc;
+  }
+};
+
+// Adler-32 checksum of zlib streams
+// see: https://www.rfc-editor.org/rfc/rfc1950
+struct Adler32
+{
+  static constexpr uint32_t base = 65521;
+
+  static uint32_t update(uint32_t adler, uint8_t const * data, size_t size)
+  {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while(size > 0)
+    {
+      // the sums can't overflow within this many bytes
+      size_t const n = std::min<size_t>(size, 5552);
+      for(size_t i = 0; i < n; i++) {
+        a += data[i];
+        b += a;
+      }
+      a %= base;
+      b %= base;
+      data += n;
+      size -= n;
+    }
+    return a | (b << 16);
+  }
+
+  // the checksum of two concatenated pieces, `size2` is the length of the second one
+  static uint32_t combine(uint32_t adler1, uint32_t adler2, size_t size2)
+  {
+    uint32_t const rem = uint32_t(size2 % base);
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = uint32_t((uint64_t(rem) * sum1) % base);
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if(sum1 >= base) sum1 -= base;
+    if(sum1 >= base) sum1 -= base;
+    if(sum2 >= 2 * base) sum2 -= 2 * base;
+    if(sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+  }
+};
+
+// Deflate compressor: greedy LZ77 over hash chains and a dynamic Huffman
+// code per block. Every call compresses independently, and unless it ends
+// the stream, the output ends on a byte boundary after an empty stored
+// block (a sync flush), so separately compressed pieces can be concatenated.
+// see: https://www.rfc-editor.org/rfc/rfc1951
+struct Deflate
+{
+  static constexpr size_t window = 32768;
+  static constexpr size_t min_match = 3;
+  static constexpr size_t max_match = 258;
+  static constexpr size_t max_chain = 64;      // match candidates tried per position
+  static constexpr size_t block_tokens = 65536; // symbols per block before a new code is built
+
+  struct Token
+  {
+    uint16_t length;   // the literal byte if `distance` is 0
+    uint16_t distance;
+  };
+
+  // writes bits least significant first, as deflate expects
+  struct BitWriter
+  {
+    std::vector<uint8_t> & out;
+    uint64_t bits = 0;
+    uint32_t count = 0;
+
+    void put(uint32_t value, uint32_t n)
+    {
+      bits |= uint64_t(value) << count;
+      count += n;
+      while(count >= 8) {
+        out.push_back(uint8_t(bits));
+        bits >>= 8;
+        count -= 8;
+      }
+    }
+
+    void align() {
+      if(count > 0)
+        put(0, 8 - count);
+    }
+  };
+
+  static constexpr uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+  };
+  static constexpr uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+  };
+  static constexpr uint16_t distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+  };
+  static constexpr uint8_t distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+  };
+
+  // index of the largest base that is not above `value`
+  template<size_t N>
+  static size_t code(uint16_t const (&base)[N], uint32_t value) {
+    return size_t(std::upper_bound(base, base + N, value) - base) - 1;
+  }
+
+  // Huffman code lengths of at most `max_bits` for `frequencies`.
+  // Too deep trees are rebuilt with flattened frequencies until they fit.
+  static std::vector<uint8_t> codeLengths(std::vector<uint32_t> frequencies, uint8_t max_bits)
+  {
+    size_t const n = frequencies.size();
+    std::vector<uint8_t> lengths(n, 0);
+    while(true)
+    {
+      // nodes [0, n) are the symbols, internal nodes follow
+      std::vector<uint32_t> parent(2 * n, 0);
+      using Entry = std::pair<uint64_t, uint32_t>;
+      std::vector<Entry> heap;
+      for(size_t i = 0; i < n; i++) {
+        if(frequencies[i] > 0)
+          heap.push_back({ frequencies[i], uint32_t(i) });
+      }
+      if(heap.empty())
+        return lengths;
+      if(heap.size() == 1) {
+        lengths[heap[0].second] = 1;
+        return lengths;
+      }
+
+      auto greater = [](Entry const & a, Entry const & b) { return a > b; };
+      std::make_heap(heap.begin(), heap.end(), greater);
+      uint32_t next = uint32_t(n);
+      while(heap.size() > 1)
+      {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        Entry a = heap.back();
+        heap.pop_back();
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        Entry b = heap.back();
+        heap.pop_back();
+        parent[a.second] = next;
+        parent[b.second] = next;
+        heap.push_back({ a.first + b.first, next++ });
+        std::push_heap(heap.begin(), heap.end(), greater);
+      }
+
+      // internal nodes are created after their children, so walk backwards
+      uint32_t const root = next - 1;
+      std::vector<uint8_t> depth(next, 0);
+      for(uint32_t node = root; node-- > 0; ) {
+        if(node >= n || frequencies[node] > 0)
+          depth[node] = depth[parent[node]] + 1;
+      }
+
+      bool fits = true;
+      for(size_t i = 0; i < n; i++) {
+        lengths[i] = (frequencies[i] > 0) ? depth[i] : 0;
+        fits = fits && lengths[i] <= max_bits;
+      }
+      if(fits)
+        return lengths;
+
+      for(uint32_t & f : frequencies) {
+        if(f > 0)
+          f = (f >> 1) | 1;
+      }
+    }
+  }
+
+  // canonical codes for `lengths`, bit reversed to be written least significant first
+  static std::vector<uint16_t> canonicalCodes(std::vector<uint8_t> const & lengths)
+  {
+    uint16_t count[16] = { };
+    for(uint8_t length : lengths)
+      count[length]++;
+    count[0] = 0;
+
+    uint16_t next[16] = { };
+    uint16_t code = 0;
+    for(size_t bits = 1; bits < 16; bits++) {
+      code = uint16_t((code + count[bits - 1]) << 1);
+      next[bits] = code;
+    }
+
+    std::vector<uint16_t> codes(lengths.size(), 0);
+    for(size_t i = 0; i < lengths.size(); i++)
+    {
+      if(lengths[i] == 0)
+        continue;
+      uint16_t c = next[lengths[i]]++;
+      uint16_t reversed = 0;
+      for(size_t b = 0; b < lengths[i]; b++)
+        reversed = uint16_t(reversed | (((c >> b) & 1) << (lengths[i] - 1 - b)));
+      codes[i] = reversed;
+    }
+    return codes;
+  }
+
+  static void writeBlock(BitWriter & writer, std::vector<Token> const & tokens, bool final)
+  {
+    std::vector<uint32_t> litlen_frequencies(286, 0), distance_frequencies(30, 0);
+    for(Token t : tokens)
+    {
+      if(t.distance == 0) {
+        litlen_frequencies[t.length]++;
+      } else {
+        litlen_frequencies[257 + code(length_base, t.length)]++;
+        distance_frequencies[code(distance_base, t.distance)]++;
+      }
+    }
+    litlen_frequencies[256] = 1; // end of block
+
+    // a distance code is always transmitted, with two entries every decoder accepts it
+    size_t used_distances = 0;
+    for(uint32_t f : distance_frequencies)
+      used_distances += (f > 0);
+    for(size_t i = 0; used_distances < 2; i++) {
+      if(distance_frequencies[i] == 0) {
+        distance_frequencies[i] = 1;
+        used_distances++;
+      }
+    }
+
+    std::vector<uint8_t> litlen_lengths = codeLengths(litlen_frequencies, 15);
+    std::vector<uint8_t> distance_lengths = codeLengths(distance_frequencies, 15);
+    std::vector<uint16_t> litlen_codes = canonicalCodes(litlen_lengths);
+    std::vector<uint16_t> distance_codes = canonicalCodes(distance_lengths);
+
+    size_t hlit = 286;
+    while(hlit > 257 && litlen_lengths[hlit - 1] == 0)
+      hlit--;
+    size_t hdist = 30;
+    while(hdist > 1 && distance_lengths[hdist - 1] == 0)
+      hdist--;
+
+    // run length encode both code length sequences together
+    std::vector<uint8_t> lengths(litlen_lengths.begin(), litlen_lengths.begin() + hlit);
+    lengths.insert(lengths.end(), distance_lengths.begin(), distance_lengths.begin() + hdist);
+
+    struct Run { uint8_t symbol, extra; };
+    std::vector<Run> runs;
+    for(size_t i = 0; i < lengths.size(); )
+    {
+      size_t run = 1;
+      while(i + run < lengths.size() && lengths[i + run] == lengths[i])
+        run++;
+
+      if(lengths[i] == 0 && run >= 3) {
+        run = std::min<size_t>(run, 138);
+        runs.push_back((run <= 10) ? Run { 17, uint8_t(run - 3) } : Run { 18, uint8_t(run - 11) });
+      } else if(lengths[i] != 0 && run >= 4) {
+        run = std::min<size_t>(run, 7);
+        runs.push_back(Run { lengths[i], 0 });
+        runs.push_back(Run { 16, uint8_t(run - 4) });
+      } else {
+        run = 1;
+        runs.push_back(Run { lengths[i], 0 });
+      }
+      i += run;
+    }
+
+    std::vector<uint32_t> length_frequencies(19, 0);
+    for(Run r : runs)
+      length_frequencies[r.symbol]++;
+    std::vector<uint8_t> length_lengths = codeLengths(length_frequencies, 7);
+    std::vector<uint16_t> length_codes = canonicalCodes(length_lengths);
+
+    static constexpr uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    size_t hclen = 19;
+    while(hclen > 4 && length_lengths[order[hclen - 1]] == 0)
+      hclen--;
+
+    writer.put(final ? 1 : 0, 1);
+    writer.put(2, 2); // dynamic Huffman codes
+    writer.put(uint32_t(hlit - 257), 5);
+    writer.put(uint32_t(hdist - 1), 5);
+    writer.put(uint32_t(hclen - 4), 4);
+    for(size_t i = 0; i < hclen; i++)
+      writer.put(length_lengths[order[i]], 3);
+    for(Run r : runs)
+    {
+      writer.put(length_codes[r.symbol], length_lengths[r.symbol]);
+      if(r.symbol == 16) writer.put(r.extra, 2);
+      if(r.symbol == 17) writer.put(r.extra, 3);
+      if(r.symbol == 18) writer.put(r.extra, 7);
+    }
+
+    for(Token t : tokens)
+    {
+      if(t.distance == 0) {
+        writer.put(litlen_codes[t.length], litlen_lengths[t.length]);
+        continue;
+      }
+      size_t lc = code(length_base, t.length);
+      writer.put(litlen_codes[257 + lc], litlen_lengths[257 + lc]);
+      writer.put(t.length - length_base[lc], length_extra[lc]);
+      size_t dc = code(distance_base, t.distance);
+      writer.put(distance_codes[dc], distance_lengths[dc]);
+      writer.put(t.distance - distance_base[dc], distance_extra[dc]);
+    }
+    writer.put(litlen_codes[256], litlen_lengths[256]);
+  }
+
+  // Appends the compressed `data` to `out`. `final` ends the deflate stream.
+  static void compress(uint8_t const * data, size_t size, bool final, std::vector<uint8_t> & out)
+  {
+    BitWriter writer { out };
+
+    constexpr size_t hash_bits = 15;
+    std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+    std::vector<int32_t> previous(window, -1);
+    auto hash = [&](size_t pos) {
+      uint32_t v = uint32_t(data[pos]) | (uint32_t(data[pos + 1]) << 8) | (uint32_t(data[pos + 2]) << 16);
+      return (v * 2654435761u) >> (32 - hash_bits);
+    };
+    auto insert = [&](size_t pos) {
+      if(pos + min_match > size)
+        return;
+      uint32_t h = hash(pos);
+      previous[pos % window] = head[h];
+      head[h] = int32_t(pos);
+    };
+
+    std::vector<Token> tokens;
+    tokens.reserve(block_tokens);
+    for(size_t pos = 0; pos < size; )
+    {
+      size_t best_length = 0, best_distance = 0;
+      if(pos + min_match <= size)
+      {
+        size_t const limit = std::min(max_match, size - pos);
+        int32_t candidate = head[hash(pos)];
+        for(size_t chain = 0; chain < max_chain && candidate >= 0 && pos - size_t(candidate) <= window; chain++)
+        {
+          uint8_t const * a = data + candidate;
+          uint8_t const * b = data + pos;
+          if(a[best_length] == b[best_length])
+          {
+            size_t length = 0;
+            while(length < limit && a[length] == b[length])
+              length++;
+            if(length > best_length) {
+              best_length = length;
+              best_distance = pos - size_t(candidate);
+              if(length == limit)
+                break;
+            }
+          }
+          int32_t before = previous[size_t(candidate) % window];
+          if(before >= candidate)
+            break; // overwritten by a newer position
+          candidate = before;
+        }
+      }
+
+      if(best_length >= min_match) {
+        tokens.push_back(Token { uint16_t(best_length), uint16_t(best_distance) });
+        for(size_t i = 0; i < best_length; i++)
+          insert(pos + i);
+        pos += best_length;
+      } else {
+        tokens.push_back(Token { data[pos], 0 });
+        insert(pos);
+        pos += 1;
+      }
+
+      if(tokens.size() == block_tokens) {
+        writeBlock(writer, tokens, final && pos == size);
+        tokens.clear();
+      }
+    }
+    if(!tokens.empty() || size == 0)
+      writeBlock(writer, tokens, final);
+
+    if(final) {
+      writer.align();
+    } else {
+      // empty stored block, so the next piece starts on a byte boundary
+      writer.put(0, 1);
+      writer.put(0, 2);
+      writer.align();
+      writer.put(0x0000, 16);
+      writer.put(0xFFFF, 16);
+    }
+  }
+};
+
+enum class ImageFormat
+{
+  ppm,
+  png,
+  pfm, // linear floats, not tone mapped
+  exr, // linear floats, not tone mapped
+};
+
+// the format is chosen by the file extension, binary PPM if none matches
+static ImageFormat imageFormat(char const * file_name)
+{
+  size_t const length = strlen(file_name);
+  char const * extension = (length >= 4) ? file_name + length - 4 : "";
+  if(strcasecmp(extension, ".png") == 0)
+    return ImageFormat::png;
+  if(strcasecmp(extension, ".pfm") == 0)
+    return ImageFormat::pfm;
+  if(strcasecmp(extension, ".exr") == 0)
+    return ImageFormat::exr;
+  return ImageFormat::ppm;
+}
+
+static bool isHdr(ImageFormat format) {
+  return format == ImageFormat::pfm || format == ImageFormat::exr;
+}
+
+// Writes an image from front to back while it is still being rendered.
+// Bands of rows arrive in any order from any thread, a background thread
+// writes every band as soon as all rows above it are on disk, so the I/O
+// overlaps the rendering. Written buffers are handed out again by `buffer()`.
+//
+// PNG bands are filtered and compressed by the thread that submits them,
+// each into its own deflate stream ending on a byte boundary, so they can
+// simply be concatenated. Only the Adler-32 of the zlib stream is put
+// together in order by the writer.
+// see: https://www.w3.org/TR/png/
+struct ImageStream
+{
+  FILE * file;
+  ImageFormat format;
+  size_t width, height;
+  bool ok;
+
+  struct Band
+  {
+    size_t rows = 0;
+    std::vector<uint8_t> bytes; // as they go to the file
+    uint32_t adler = 1;         // of the uncompressed PNG scanlines
+    size_t raw_size = 0;
+  };
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<Band> pending; // indexed by the first row of a band
+  std::vector<std::vector<uint8_t>> spare;
+  size_t written = 0; // rows
+  uint32_t adler = 1;
+  std::thread writer;
+
+  ImageStream(char const * file_name, ImageFormat format, size_t width, size_t height) :
+    file(fopen(file_name, "wb")),
+    format(format),
+    width(width), height(height),
+    ok(file != nullptr),
+    pending(height)
+  {
+    if(file == nullptr)
+      return;
+
+    if(format == ImageFormat::png)
+    {
+      static constexpr uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+      uint8_t header[13] = { };
+      storeBigEndian(header + 0, uint32_t(width));
+      storeBigEndian(header + 4, uint32_t(height));
+      header[8] = 8; // bits per channel
+      header[9] = 2; // rgb
+      std::vector<uint8_t> start(signature, signature + sizeof signature);
+      appendChunk(start, "IHDR", header, sizeof header);
+      ok = fwrite(start.data(), 1, start.size(), file) == start.size();
+    } else {
+      ok = fprintf(file, "P6 %lu %lu 255\n", width, height) > 0;
+    }
+    // callers stop submitting when the header failed, so a writer would wait forever
+    if(ok)
+      writer = std::thread([this] { write(); });
+  }
+
+  ~ImageStream()
+  {
+    finish();
+  }
+
+  // a buffer for the next band, possibly one that was already written
+  std::vector<uint8_t> buffer()
+  {
+    std::lock_guard<std::mutex> guard { mutex };
+    if(spare.empty())
+      return { };
+    std::vector<uint8_t> result = std::move(spare.back());
+    spare.pop_back();
+    return result;
+  }
+
+  // `rgb` holds whole rows starting at `first_row`
+  void submit(size_t first_row, std::vector<uint8_t> rgb)
+  {
+    Band band;
+    band.rows = rgb.size() / (3 * width);
+    if(format == ImageFormat::png) {
+      encode(first_row, rgb, band);
+    } else {
+      band.bytes = std::move(rgb);
+    }
+
+    {
+      std::lock_guard<std::mutex> guard { mutex };
+      pending[first_row] = std::move(band);
+      if(!rgb.empty())
+        spare.push_back(std::move(rgb));
+    }
+    changed.notify_one();
+  }
+
+  // Waits until all rows are written and closes the file.
+  // Must only be called once every row was submitted.
+  bool finish()
+  {
+    if(file == nullptr)
+      return false;
+    if(writer.joinable())
+      writer.join();
+
+    if(format == ImageFormat::png)
+    {
+      // the zlib checksum closes the image data, in a chunk of its own
+      uint8_t checksum[4];
+      storeBigEndian(checksum, adler);
+      std::vector<uint8_t> end;
+      appendChunk(end, "IDAT", checksum, sizeof checksum);
+      appendChunk(end, "IEND", nullptr, 0);
+      ok = ok && fwrite(end.data(), 1, end.size(), file) == end.size();
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    file = nullptr;
+    return ok;
+  }
+
+private:
+  static void storeBigEndian(uint8_t * out, uint32_t value)
+  {
+    out[0] = uint8_t(value >> 24);
+    out[1] = uint8_t(value >> 16);
+    out[2] = uint8_t(value >> 8);
+    out[3] = uint8_t(value);
+  }
+
+  static void appendChunk(std::vector<uint8_t> & out, char const * type, uint8_t const * data, size_t size)
+  {
+    size_t const start = out.size();
+    out.resize(start + 12 + size);
+    storeBigEndian(out.data() + start, uint32_t(size));
+    memcpy(out.data() + start + 4, type, 4);
+    if(size > 0)
+      memcpy(out.data() + start + 8, data, size);
+    // the crc covers the type and the data
+    uint32_t crc = Crc32::instance().update(0, out.data() + start + 4, 4 + size);
+    storeBigEndian(out.data() + start + 8 + size, crc);
+  }
+
+  // Turns the rows of `rgb` into an IDAT chunk. Every row gets the filter
+  // with the smallest sum of absolute differences, the usual heuristic.
+  // The first row of a band only looks at itself, so bands stay independent.
+  // see: https://www.w3.org/TR/png/#12Filter-selection
+  void encode(size_t first_row, std::vector<uint8_t> const & rgb, Band & band) const
+  {
+    size_t const row_size = 3 * width;
+    std::vector<uint8_t> filtered(band.rows * (1 + row_size));
+    std::array<std::vector<uint8_t>, 5> candidates;
+    for(auto & candidate : candidates)
+      candidate.resize(row_size);
+    std::vector<uint8_t> const zero(row_size, 0);
+
+    for(size_t y = 0; y < band.rows; y++)
+    {
+      uint8_t const * row = rgb.data() + y * row_size;
+      uint8_t const * up = (y > 0) ? row - row_size : zero.data();
+      size_t const filters = (y > 0) ? 5 : 2;
+
+      size_t best = 0;
+      uint64_t best_cost = std::numeric_limits<uint64_t>::max();
+      for(size_t filter = 0; filter < filters; filter++)
+      {
+        uint8_t * out = candidates[filter].data();
+        uint64_t cost = 0;
+        for(size_t i = 0; i < row_size; i++)
+        {
+          int a = (i >= 3) ? row[i - 3] : 0;
+          int b = up[i];
+          int c = (i >= 3) ? up[i - 3] : 0;
+          int predicted = 0;
+          switch(filter) {
+            case 1: predicted = a; break;
+            case 2: predicted = b; break;
+            case 3: predicted = (a + b) / 2; break;
+            case 4: {
+              int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+              predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+              break;
+            }
+          }
+          out[i] = uint8_t(row[i] - predicted);
+          cost += uint64_t(std::abs(int(int8_t(out[i]))));
+        }
+        if(cost < best_cost) {
+          best_cost = cost;
+          best = filter;
+        }
+      }
+
+      uint8_t * line = filtered.data() + y * (1 + row_size);
+      line[0] = uint8_t(best);
+      memcpy(line + 1, candidates[best].data(), row_size);
+    }
+
+    band.raw_size = filtered.size();
+    band.adler = Adler32::update(1, filtered.data(), filtered.size());
+
+    std::vector<uint8_t> compressed;
+    if(first_row == 0) {
+      // zlib header: deflate with a 32 KiB window, fast compression
+      compressed = { 0x78, 0x5E };
+    }
+    Deflate::compress(filtered.data(), filtered.size(), first_row + band.rows == height, compressed);
+    appendChunk(band.bytes, "IDAT", compressed.data(), compressed.size());
+  }
+
+  void write()
+  {
+    std::unique_lock<std::mutex> lock { mutex };
+    while(written < height)
+    {
+      changed.wait(lock, [&] { return pending[written].rows > 0; });
+      Band band = std::move(pending[written]);
+      pending[written] = Band { };
+
+      lock.unlock();
+      bool band_ok = fwrite(band.bytes.data(), 1, band.bytes.size(), file) == band.bytes.size();
+      lock.lock();
+
+      ok = ok && band_ok;
+      adler = Adler32::combine(adler, band.adler, band.raw_size);
+      written += band.rows;
+      if(format == ImageFormat::ppm)
+        spare.push_back(std::move(band.bytes));
+    }
+  }
+};
+
+// Calls `submit(begin, end)` for bands of `band` rows on `threads` threads,
+// for ImageStream, whose PNG encoder then compresses in parallel.
+template<typename F>
+static void forEachBand(size_t height, size_t band, size_t threads, F const & submit)
+{
+  size_t const bands = (height + band - 1) / band;
+  WorkStealingPool pool { threads };
+  pool.run(bands, [&](size_t index, size_t) {
+    submit(index * band, std::min(height, (index + 1) * band));
+  });
+}
+
+// Writes linear colors without tone mapping or quantization, as a portable
+// float map or a single part EXR with the channels R, G and B. The rows are
+// fetched in bands by `rows(begin, end, pixels)`, so the whole image never
+// has to be in memory. A PFM band is written as it is, since Color has the
+// memory layout of a PFM pixel.
+// see: https://www.pauldebevec.com/Research/HDR/PFM/
+template<typename F>
+static bool saveHdr(char const * file_name, ImageFormat format, size_t width, size_t height, F const & rows)
+{
+  static_assert(sizeof(Color) == 3 * sizeof(float), "Color must be three packed floats");
+
+  FILE * f = fopen(file_name, "wb");
+  if(f == nullptr)
+    return false;
+
+  bool ok = true;
+  size_t const band = 64;
+  std::vector<Color> pixels;
+  if(format == ImageFormat::pfm)
+  {
+    // a negative scale marks little endian floats
+    uint16_t const probe = 1;
+    uint8_t little_endian;
+    memcpy(&little_endian, &probe, 1);
+    ok = fprintf(f, "PF\n%zu %zu\n%s\n", width, height, little_endian ? "-1.0" : "1.0") > 0;
+
+    // rows go from the bottom to the top
+    for(size_t end = height; ok && end > 0; end -= std::min(end, band))
+    {
+      size_t const begin = end - std::min(end, band);
+      pixels.resize((end - begin) * width);
+      rows(begin, end, pixels.data());
+      for(size_t y = end; ok && y-- > begin; )
+        ok = fwrite(pixels.data() + (y - begin) * width, sizeof(Color), width, f) == width;
+    }
+  }
+  else
+  {
+    ExrImage exr { width, height, { } };
+    for(char const * name : { "R", "G", "B" })
+      exr.channels.push_back(ExrImage::Channel { name, ExrImage::Type::float32, { } });
+    std::vector<uint8_t> const header = exr.header();
+    ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+
+    // every scan line: y, size, then the planes in alphabetical order
+    std::vector<uint32_t> line(2 + 3 * width);
+    for(size_t begin = 0; ok && begin < height; begin += band)
+    {
+      size_t const end = std::min(height, begin + band);
+      pixels.resize((end - begin) * width);
+      rows(begin, end, pixels.data());
+      for(size_t y = begin; ok && y < end; y++)
+      {
+        Color const * row = pixels.data() + (y - begin) * width;
+        line[0] = uint32_t(y);
+        line[1] = uint32_t(exr.lineSize());
+        for(size_t x = 0; x < width; x++) {
+          memcpy(&line[2 + x], &row[x].b, 4);
+          memcpy(&line[2 + width + x], &row[x].g, 4);
+          memcpy(&line[2 + 2 * width + x], &row[x].r, 4);
+        }
+        ok = fwrite(line.data(), 4, line.size(), f) == line.size();
+      }
+    }
+  }
+
+  ok = (fclose(f) == 0) && ok;
+  return ok;
+}
+
+// root mean square difference of two 8 bit images
+// Samplers for another frame of a sequence keep what depends on the seed alone.
+static void setFrame(UniformSampler &, uint32_t, uint32_t) { }
+static void setFrame(SobolSampler & sampler, uint32_t seed, uint32_t frame) {
+  sampler = SobolSampler { seed, frame };
+}
+static void setFrame(BlueNoiseSampler & sampler, uint32_t seed, uint32_t frame) {
+  sampler.sobol = SobolSampler { seed, frame };
+}
+
+static double imageError(std::vector<uint8_t> const & a, std::vector<uint8_t> const & b)
+{
+  double sum = 0.0;
+  for(size_t i = 0; i < a.size(); i++)
+  {
+    double d = double(a[i]) - double(b[i]);
+    sum += d * d;
+  }
+  return std::sqrt(sum / double(a.size()));
+}
+
+// Compares denoised 4 and 8 spp renders with plain renders of 4 spp up to
+// `base.super_sampling`, but at least 8, and reports, for every denoised render, the most
+// plain samples it is still at least as close to a reference with four
+// times as many samples as. The reference is rendered as the next frame, so
+// it shares no samples with the renders it judges.
+static void denoiseBenchmark(Scene const & scene, Camera const & camera, RenderSettings const & base, Sampler const & sampler)
+{
+  size_t const iterations = (base.denoise.iterations > 0) ? base.denoise.iterations : 1;
+  PostProcess const post { base.post };
+
+  // returns the final image and the seconds it took
+  auto render = [&](size_t spp, bool denoise, uint32_t frame)
+  {
+    RenderSettings settings = base;
+    settings.super_sampling = spp;
+    settings.progressive = ProgressiveSettings { };
+    settings.denoise.iterations = denoise ? iterations : 0;
+    settings.frame = frame;
+    Sampler frame_sampler = sampler;
+    std::visit([&](auto & s) { setFrame(s, settings.seed, frame); }, frame_sampler);
+
+    auto const start = std::chrono::steady_clock::now();
+    Renderer renderer { scene, camera, settings, frame_sampler };
+    Accumulator accumulator { settings.width, settings.height };
+    if(denoise)
+      accumulator.features.emplace(settings.width, settings.height);
+    renderer.render(accumulator, [](Accumulator const &) { }, [](size_t, size_t) { });
+    Image image = accumulator.resolve();
+    if(denoise)
+      Denoiser { settings.denoise, settings.threadCount() }.apply(image, accumulator.features->resolve(), accumulator.variance());
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return std::make_tuple(post.apply(image, settings.threadCount()), seconds);
+  };
+
+  auto [reference, reference_time] = render(4 * base.super_sampling, false, base.frame + 1);
+  printf("reference: %zu spp, %.3f s\n", 4 * base.super_sampling, reference_time);
+  printf("%6s %9s %10s %10s\n", "spp", "denoised", "time [s]", "rmse");
+
+  struct Run { size_t spp; bool denoise; double error; };
+  std::vector<Run> runs;
+  size_t const most = std::max<size_t>(8, base.super_sampling);
+  for(size_t spp = 4; spp < most; spp *= 2)
+    runs.push_back(Run { spp, false, 0.0 });
+  runs.push_back(Run { most, false, 0.0 });
+  runs.push_back(Run { 4, true, 0.0 });
+  runs.push_back(Run { 8, true, 0.0 });
+  for(Run & run : runs)
+  {
+    auto [image, seconds] = render(run.spp, run.denoise, base.frame);
+    run.error = imageError(image, reference);
+    printf("%6zu %9s %10.3f %10.3f\n", run.spp, run.denoise ? "yes" : "no", seconds, run.error);
+  }
+
+  for(Run const & denoised : runs)
+  {
+    if(!denoised.denoise)
+      continue;
+    size_t equal = 0;
+    for(Run const & plain : runs)
+      if(!plain.denoise && plain.error >= denoised.error)
+        equal = std::max(equal, plain.spp);
+    if(equal == 0)
+      printf("denoised %zu spp: worse than 4 plain spp\n", denoised.spp);
+    else
+      printf("denoised %zu spp: as good as %zu plain spp\n", denoised.spp, equal);
+  }
+}
+
+// Writes 8 bit rgb frames to a file or stdout, as YUV4MPEG2 or raw rgb.
+// YUV uses the BT.601 matrix with video range, the chroma of every 2x2
+// block is the average of its pixels.
+// see: https://wiki.multimedia.cx/index.php/YUV4MPEG2
+struct VideoStream
+{
+  FILE * file;
+  VideoFormat format;
+  size_t width, height;
+  size_t threads;
+  bool ok;
+  std::vector<uint8_t> yuv;
+
+  VideoStream(char const * file_name, VideoFormat format, size_t width, size_t height, uint32_t fps, size_t threads) :
+    file(strcmp(file_name, "-") == 0 ? stdout : fopen(file_name, "wb")),
+    format(format),
+    width(width), height(height),
+    threads(threads),
+    ok(file != nullptr)
+  {
+    if(ok && format == VideoFormat::y4m)
+      ok = fprintf(file, "YUV4MPEG2 W%zu H%zu F%u:1 Ip A1:1 C420jpeg\n", width, height, fps) > 0;
+  }
+
+  ~VideoStream()
+  {
+    finish();
+  }
+
+  bool write(std::vector<uint8_t> const & rgb)
+  {
+    if(!ok)
+      return false;
+    if(format == VideoFormat::rgb) {
+      ok = fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+      return ok;
+    }
+
+    size_t const chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+    yuv.resize(width * height + 2 * chroma_width * chroma_height);
+    uint8_t * luma = yuv.data();
+    uint8_t * u = luma + width * height;
+    uint8_t * v = u + chroma_width * chroma_height;
+
+    // one job per pair of rows, which share a row of chroma
+    forEachBand(chroma_height, 8, threads, [&](size_t begin, size_t end) {
+      for(size_t cy = begin; cy < end; cy++)
+      {
+        for(size_t y = 2 * cy; y < std::min(height, 2 * cy + 2); y++)
+        {
+          for(size_t x = 0; x < width; x++) {
+            uint8_t const * p = rgb.data() + 3 * (y * width + x);
+            luma[y * width + x] = uint8_t(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+          }
+        }
+        for(size_t cx = 0; cx < chroma_width; cx++)
+        {
+          int r = 0, g = 0, b = 0, n = 0;
+          for(size_t y = 2 * cy; y < std::min(height, 2 * cy + 2); y++) {
+            for(size_t x = 2 * cx; x < std::min(width, 2 * cx + 2); x++) {
+              uint8_t const * p = rgb.data() + 3 * (y * width + x);
+              r += p[0]; g += p[1]; b += p[2]; n++;
+            }
+          }
+          r /= n; g /= n; b /= n;
+          u[cy * chroma_width + cx] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+          v[cy * chroma_width + cx] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+      }
+    });
+
+    ok = fputs("FRAME\n", file) >= 0 && fwrite(yuv.data(), 1, yuv.size(), file) == yuv.size();
+    // a reader on a pipe gets every frame as soon as it is done
+    ok = fflush(file) == 0 && ok;
+    return ok;
+  }
+
+  bool finish()
+  {
+    if(file == nullptr)
+      return false;
+    ok = ((file == stdout) ? fflush(file) : fclose(file)) == 0 && ok;
+    file = nullptr;
+    return ok;
+  }
+};
+
+// Renders `base.sequence.frames` frames in one go and streams them as
+// video. Frame i orbits the camera by i / frames of the orbit around the
+// origin and draws from the sample streams of frame `base.frame + i`, so
+// every frame can be rendered again on its own.
+static bool renderSequence(Scene const & scene, RenderSettings const & base, Sampler sampler)
+{
+  SequenceSettings const & sequence = base.sequence;
+  PostProcess const post { base.post };
+  VideoStream video { sequence.output, sequence.format, base.width, base.height, sequence.fps, base.threadCount() };
+  if(!video.ok) {
+    fprintf(stderr, "failed to write %s\n", sequence.output);
+    return false;
+  }
+
+  std::vector<uint8_t> rgb(3 * base.width * base.height);
+  for(size_t i = 0; i < sequence.frames; i++)
+  {
+    auto const start = std::chrono::steady_clock::now();
+
+    RenderSettings settings = base;
+    settings.frame = base.frame + uint32_t(i);
+    std::visit([&](auto & s) { setFrame(s, settings.seed, settings.frame); }, sampler);
+
+    float const angle = sequence.orbit * float(i) / float(sequence.frames) * float(M_PI / 180.0);
+    Camera camera;
+    camera.lookAt(
+      Vec3(sequence.orbit_radius * std::sin(angle), 0, -sequence.orbit_radius * std::cos(angle)),
+      Vec3(0,0,0),
+      Vec3(0,1,0)
+    );
+
+    Renderer renderer { scene, camera, settings, sampler };
+    Accumulator accumulator { settings.width, settings.height };
+    if(settings.denoise.iterations > 0)
+      accumulator.features.emplace(settings.width, settings.height);
+    auto finished = [&](size_t begin, size_t end)
+    {
+      if(settings.denoise.iterations > 0)
+        return;
+      std::vector<Color> pixels((end - begin) * settings.width);
+      accumulator.resolveRows(begin, end, pixels.data());
+      post.apply(pixels.data(), rgb.data() + 3 * begin * settings.width, pixels.size());
+    };
+    RenderStats stats = renderer.render(accumulator, [](Accumulator const &) { }, finished);
+
+    if(settings.denoise.iterations > 0) {
+      Image image = accumulator.resolve();
+      Denoiser { settings.denoise, settings.threadCount() }.apply(image, accumulator.features->resolve(), accumulator.variance());
+      rgb = post.apply(image, settings.threadCount());
+    }
+
+    if(!video.write(rgb)) {
+      fprintf(stderr, "failed to write frame %zu to %s\n", i, sequence.output);
+      return false;
+    }
+    if(settings.stats) {
+      fprintf(stderr, "frame %zu: %.3f s, %.3f s rendering\n",
+        i,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+        stats.render_time
+      );
+    }
+  }
+
+  if(!video.finish()) {
+    fprintf(stderr, "failed to write %s\n", sequence.output);
+    return false;
+  }
+  return true;
+}
+
+// Writes the linear image and everything known about the primary hits:
+// R, G, B, Z (depth), N.X, N.Y, N.Z, albedo.R, albedo.G, albedo.B as floats,
+// averaged over the rendered samples, id (index + 1 of the object under the
+// sample closest to the pixel center, 0 for none) and samples as unsigned integers.
+static bool saveAovs(char const * file_name, Image const & image, Accumulator const & accumulator, FeatureBuffers const & features)
+{
+  size_t const count = image.width * image.height;
+  ExrImage exr { image.width, image.height, { } };
+
+  std::vector<float> values[3];
+  auto addColor = [&](std::string const & prefix, std::vector<Color> const & colors) {
+    for(auto & v : values)
+      v.resize(count);
+    for(size_t i = 0; i < count; i++) {
+      values[0][i] = colors[i].r;
+      values[1][i] = colors[i].g;
+      values[2][i] = colors[i].b;
+    }
+    exr.add(prefix + "R", values[0]);
+    exr.add(prefix + "G", values[1]);
+    exr.add(prefix + "B", values[2]);
+  };
+  addColor("", image.pixels);
+  addColor("albedo.", features.albedo);
+
+  for(size_t i = 0; i < count; i++) {
+    values[0][i] = features.normal[i].x;
+    values[1][i] = features.normal[i].y;
+    values[2][i] = features.normal[i].z;
+  }
+  exr.add("N.X", values[0]);
+  exr.add("N.Y", values[1]);
+  exr.add("N.Z", values[2]);
+
+  exr.add("Z", features.depth);
+  exr.add("id", features.object);
+  exr.add("samples", std::vector<uint32_t>(accumulator.samples.begin(), accumulator.samples.end()));
+  return exr.save(file_name);
+}
+
+static void printUsage(char const * program)
+{
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  --output <file>   file the image is written to, by extension: .png for PNG, .pfm\n"
+    "                    or .exr for linear floats without tone mapping, binary PPM\n"
+    "                    otherwise (default: output.pgm)\n"
+    "  --framebuffer <file>  keep the accumulated samples in this file instead of memory and\n"
+    "                    render band by band, for images larger than memory\n"
+    "  --shm <name>      keep the accumulated samples in a POSIX shared memory object for\n"
+    "                    live viewers instead of writing previews, see the README\n"
+    "  --aov <file>      also write the linear image with depth, normal, albedo, object id\n"
+    "                    and sample count of every pixel to this exr file, recorded from\n"
+    "                    the primary hits of the rendered samples\n"
+    "  --width <n>       image width in pixels (default: 512)\n"
+    "  --height <n>      image height in pixels (default: 512)\n"
+    "  --spp <n>         samples per pixel (default: 64)\n"
+    "  --tile-size <n>   edge length of a render tile in pixels (default: 32)\n"
+    "  --threads <n>     number of render threads, 0 for all cores (default: 0)\n"
+    "  --seed <n>        seed for the sample jitter (default: 0)\n"
+    "  --spheres <n>     number of random spheres added to the scene (default: 0)\n"
+    "  --mode <mode>     single: trace one sample at a time (default)\n"
+    "                    packets: trace the samples of a pixel in packets of simd width\n"
+    "                    wavefront: trace a whole tile stage by stage through ray queues\n"
+    "  --sampler <type>  uniform: independent random numbers for every sample\n"
+    "                    sobol: scrambled sobol points per pixel (default)\n"
+    "                    blue-noise: sobol points shifted by a blue noise mask\n"
+    "  --sort-rays       sort wavefront queues by material and ray direction\n"
+    "  --stats           print statistics to stderr\n"
+    "progressive rendering:\n"
+    "  --pass-spp <n>             render in passes of this many samples per pixel and\n"
+    "                             update the output after each pass (default: 0, one pass)\n"
+    "  --snapshot-interval <f>    minimum seconds between two updates of the output (default: 0)\n"
+    "  --time-budget <f>          add passes until this many seconds after start are used up,\n"
+    "                             ignoring --spp; passes default to 1 spp (default: 0, disabled)\n"
+    "  --checkpoint <file>        save the accumulated samples with every update of the\n"
+    "                             output and at the end\n"
+    "  --resume <file>            continue from a checkpoint up to --spp samples per pixel\n"
+    "adaptive sampling:\n"
+    "  --adaptive <f>             stop sampling a pixel when the relative error of its mean\n"
+    "                             falls below this, --spp is the maximum (default: 0, disabled)\n"
+    "  --min-spp <n>              samples per pixel before the error is checked (default: 16)\n"
+    "path options:\n"
+    "  --max-depth <n>            maximum number of reflections (default: 10)\n"
+    "  --min-throughput <f>       stop paths whose throughput falls below this (default: 0)\n"
+    "  --russian-roulette <n>     randomly stop paths from this depth on, 0 disables it (default: 0)\n"
+    "post processing:\n"
+    "  --tonemap <op>             exposure: 1 - exp(-x) (default)\n"
+    "                             reinhard: x / (x + 1)\n"
+    "                             aces: filmic curve fitted to aces\n"
+    "  --exposure <f>             scale of the linear image before tone mapping (default: 1)\n"
+    "  --gamma <f>                display gamma (default: 2.2)\n"
+    "denoising:\n"
+    "  --denoise <n>              experimental: edge avoiding filter passes over the final image,\n"
+    "                             0 disables it (default: 0). It smooths sampling noise but can't\n"
+    "                             restore aliased edges, the only noise of the built in scene\n"
+    "  --denoise-benchmark        compare denoised 4 and 8 spp renders with plain renders of up\n"
+    "                             to --spp against a 4 * --spp reference instead of rendering\n"
+    "animation:\n"
+    "  --frames <n>               render this many frames with the camera orbiting the scene and\n"
+    "                             stream them as video instead of writing --output (default: 0)\n"
+    "  --orbit <f>                degrees the camera turns over all frames (default: 360)\n"
+    "  --orbit-radius <f>         distance of the camera from the center (default: 7)\n"
+    "  --fps <n>                  frame rate in the y4m header (default: 30)\n"
+    "  --video <file>             file or pipe the frames are written to, - for stdout (default: -)\n"
+    "  --video-format <format>    y4m: YUV4MPEG2, 4:2:0 (default)\n"
+    "                             rgb: raw 8 bit rgb frames\n"
+    "bvh options:\n"
+    "  --bvh-bins <n>             split candidates per axis (default: 16)\n"
+    "  --bvh-leaf-size <n>        maximum number of primitives per leaf (default: 4 or the simd width)\n"
+    "  --bvh-traversal-cost <f>   cost of a node visit relative to a primitive test (default: 1)\n",
+    program
+  );
+}
+
+static bool parseValue(char const * text, size_t & value)
+{
+  char * end = nullptr;
+  unsigned long long result = strtoull(text, &end, 10);
+  if(end == text || *end != 0 || text[0] == '-')
+    return false;
+  value = size_t(result);
+  return true;
+}
+
+static bool parseValue(char const * text, uint32_t & value)
+{
+  size_t result;
+  if(!parseValue(text, result) || result > std::numeric_limits<uint32_t>::max())
+    return false;
+  value = uint32_t(result);
+  return true;
+}
+
+static bool parseValue(char const * text, float & value)
+{
+  char * end = nullptr;
+  float result = strtof(text, &end);
+  if(end == text || *end != 0)
+    return false;
+  value = result;
+  return true;
+}
+
+static bool parseValue(char const * text, char const * & value)
+{
+  value = text;
+  return true;
+}
+
+static bool parseValue(char const * text, TraceMode & value)
+{
+  if(strcmp(text, "single") == 0)
+    value = TraceMode::single;
+  else if(strcmp(text, "packets") == 0)
+    value = TraceMode::packets;
+  else if(strcmp(text, "wavefront") == 0)
+    value = TraceMode::wavefront;
+  else
+    return false;
+  return true;
+}
+
+static bool parseValue(char const * text, ToneMap & value)
+{
+  if(strcmp(text, "exposure") == 0)
+    value = ToneMap::exposure;
+  else if(strcmp(text, "reinhard") == 0)
+    value = ToneMap::reinhard;
+  else if(strcmp(text, "aces") == 0)
+    value = ToneMap::aces;
+  else
+    return false;
+  return true;
+}
+
+static bool parseValue(char const * text, SamplerType & value)
+{
+  if(strcmp(text, "uniform") == 0)
+    value = SamplerType::uniform;
+  else if(strcmp(text, "sobol") == 0)
+    value = SamplerType::sobol;
+  else if(strcmp(text, "blue-noise") == 0)
+    value = SamplerType::blue_noise;
+  else
+    return false;
+  return true;
+}
+
+static bool parseValue(char const * text, VideoFormat & value)
+{
+  if(strcmp(text, "y4m") == 0)
+    value = VideoFormat::y4m;
+  else if(strcmp(text, "rgb") == 0)
+    value = VideoFormat::rgb;
+  else
+    return false;
+  return true;
+}
+
+static bool parseArguments(int argc, char ** argv, RenderSettings & settings)
+{
+  for(int i = 1; i < argc; i++)
+  {
+    char const * arg = argv[i];
+
+    // options without a value
+    if(strcmp(arg, "--help") == 0)
+      return false;
+    if(strcmp(arg, "--stats") == 0) {
+      settings.stats = true;
+      continue;
+    }
+    if(strcmp(arg, "--denoise-benchmark") == 0) {
+      settings.denoise.benchmark = true;
+      continue;
+    }
+    if(strcmp(arg, "--sort-rays") == 0) {
+      settings.sort_rays = true;
+      continue;
+    }
+
+    if(i + 1 >= argc) {
+      fprintf(stderr, "missing value or unknown option: %s\n", arg);
+      return false;
+    }
+    char const * text = argv[++i];
+
+    bool valid;
+    if(strcmp(arg, "--output") == 0)
+      valid = parseValue(text, settings.output);
+    else if(strcmp(arg, "--width") == 0)
+      valid = parseValue(text, settings.width);
+    else if(strcmp(arg, "--height") == 0)
+      valid = parseValue(text, settings.height);
+    else if(strcmp(arg, "--spp") == 0)
+      valid = parseValue(text, settings.super_sampling);
+    else if(strcmp(arg, "--tile-size") == 0)
+      valid = parseValue(text, settings.tile_size);
+    else if(strcmp(arg, "--threads") == 0)
+      valid = parseValue(text, settings.threads);
+    else if(strcmp(arg, "--seed") == 0)
+      valid = parseValue(text, settings.seed);
+    else if(strcmp(arg, "--spheres") == 0)
+      valid = parseValue(text, settings.extra_spheres);
+    else if(strcmp(arg, "--mode") == 0)
+      valid = parseValue(text, settings.mode);
+    else if(strcmp(arg, "--tonemap") == 0)
+      valid = parseValue(text, settings.post.tone_map);
+    else if(strcmp(arg, "--exposure") == 0)
+      valid = parseValue(text, settings.post.exposure) && settings.post.exposure > 0.0f;
+    else if(strcmp(arg, "--gamma") == 0)
+      valid = parseValue(text, settings.post.gamma) && settings.post.gamma > 0.0f;
+    else if(strcmp(arg, "--framebuffer") == 0)
+      valid = parseValue(text, settings.framebuffer);
+    else if(strcmp(arg, "--shm") == 0)
+      valid = parseValue(text, settings.shared_memory);
+    else if(strcmp(arg, "--frames") == 0)
+      valid = parseValue(text, settings.sequence.frames);
+    else if(strcmp(arg, "--orbit") == 0)
+      valid = parseValue(text, settings.sequence.orbit);
+    else if(strcmp(arg, "--orbit-radius") == 0)
+      valid = parseValue(text, settings.sequence.orbit_radius);
+    else if(strcmp(arg, "--fps") == 0)
+      valid = parseValue(text, settings.sequence.fps) && settings.sequence.fps > 0;
+    else if(strcmp(arg, "--video") == 0)
+      valid = parseValue(text, settings.sequence.output);
+    else if(strcmp(arg, "--video-format") == 0)
+      valid = parseValue(text, settings.sequence.format);
+    else if(strcmp(arg, "--aov") == 0)
+      valid = parseValue(text, settings.aov_output);
+    else if(strcmp(arg, "--denoise") == 0)
+      valid = parseValue(text, settings.denoise.iterations);
+    else if(strcmp(arg, "--sampler") == 0)
+      valid = parseValue(text, settings.sampler);
+    else if(strcmp(arg, "--pass-spp") == 0)
+      valid = parseValue(text, settings.progressive.pass_samples);
+    else if(strcmp(arg, "--time-budget") == 0)
+      valid = parseValue(text, settings.progressive.time_budget);
+    else if(strcmp(arg, "--checkpoint") == 0)
+      valid = parseValue(text, settings.progressive.checkpoint);
+    else if(strcmp(arg, "--resume") == 0)
+      valid = parseValue(text, settings.progressive.resume);
+    else if(strcmp(arg, "--snapshot-interval") == 0)
+      valid = parseValue(text, settings.progressive.snapshot_interval);
+    else if(strcmp(arg, "--adaptive") == 0)
+      valid = parseValue(text, settings.adaptive.threshold);
+    else if(strcmp(arg, "--min-spp") == 0)
+      valid = parseValue(text, settings.adaptive.min_samples);
+    else if(strcmp(arg, "--max-depth") == 0)
+      valid = parseValue(text, settings.trace.max_depth);
+    else if(strcmp(arg, "--min-throughput") == 0)
+      valid = parseValue(text, settings.trace.min_throughput);
+    else if(strcmp(arg, "--russian-roulette") == 0)
+      valid = parseValue(text, settings.trace.russian_roulette_depth);
+    else if(strcmp(arg, "--bvh-bins") == 0)
+      valid = parseValue(text, settings.bvh.bin_count);
+    else if(strcmp(arg, "--bvh-leaf-size") == 0)
+      valid = parseValue(text, settings.bvh.max_leaf_size) && settings.bvh.max_leaf_size <= 0xFFFF;
+    else if(strcmp(arg, "--bvh-traversal-cost") == 0)
+      valid = parseValue(text, settings.bvh.traversal_cost);
+    else {
+      fprintf(stderr, "unknown option: %s\n", arg);
+      return false;
+    }
+
+    if(!valid) {
+      fprintf(stderr, "invalid value for %s: %s\n", arg, text);
+      return false;
+    }
+  }
+
+  if(settings.width < 2 || settings.height < 2 || settings.super_sampling == 0) {
+    fprintf(stderr, "image must be at least 2x2 pixels with one sample per pixel\n");
+    return false;
+  }
+  if(settings.framebuffer != nullptr && (settings.denoise.iterations > 0 || settings.aov_output != nullptr)) {
+    fprintf(stderr, "denoising and aovs need the whole image in memory and can't be used with --framebuffer\n");
+    return false;
+  }
+  if(settings.sequence.frames > 0 && (settings.framebuffer != nullptr || settings.aov_output != nullptr || settings.progressive.checkpoint != nullptr || settings.progressive.resume != nullptr || settings.progressive.time_budget > 0.0f)) {
+    fprintf(stderr, "--frames can't be combined with --framebuffer, --aov, --checkpoint, --resume or --time-budget\n");
+    return false;
+  }
+  if(settings.shared_memory != nullptr && (settings.framebuffer != nullptr || settings.sequence.frames > 0)) {
+    fprintf(stderr, "--shm can't be combined with --framebuffer or --frames\n");
+    return false;
+  }
+  if(settings.denoise.iterations > 10) {
+    fprintf(stderr, "at most 10 denoising passes are supported\n");
+    return false;
+  }
+  if(settings.adaptive.threshold > 0.0f && settings.mode == TraceMode::wavefront) {
+    fprintf(stderr, "adaptive sampling is not supported in wavefront mode\n");
+    return false;
+  }
+  if(settings.adaptive.threshold > 0.0f && (settings.progressive.pass_samples > 0 || settings.progressive.time_budget > 0.0f)) {
+    fprintf(stderr, "adaptive sampling can't be combined with progressive passes\n");
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  auto const start = std::chrono::steady_clock::now();
+
+  RenderSettings settings;
+  if(!parseArguments(argc, argv, settings)) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  Camera camera;
+  camera.lookAt(
+    Vec3(0,0,-10), 
+    Vec3(0,0,0), 
     Vec3(0,1,0)
   );
 
@@ -441,63 +5125,244 @@ int main()
   scene.lights.push_back(PointLight { Vec3{5,5,0}, 10.0f, Color{1,0.5,0.5} });
   scene.lights.push_back(PointLight { Vec3{-5,5,0}, 10.0f, Color{0.5,0.5,1} });
 
-  size_t super_sampling = 64;
-  std::default_random_engine rng;
-  std::uniform_real_distribution<float> rng_dist(-0.5, 0.5);
-  
-  for(size_t y = 0; y < target.height; y++)
+  // optional clutter to stress the acceleration structure
+  Material clutter { Color(0.9, 0.8, 0.6), 0.0 };
+  for(size_t i = 0; i < settings.extra_spheres; i++)
   {
-    for(size_t x = 0; x < target.width; x++)
-    {
-      Color final { 0.0 };
-      for(size_t i = 0; i < super_sampling; i++)
-      {
-        float dx = rng_dist(rng);
-        float dy = rng_dist(rng);
+    SampleRng rng { settings.seed, 0, i, 0xFFFFFFFF };
+    float radius = 0.05f + 0.25f * rng.next() / std::cbrt(float(1 + settings.extra_spheres / 64));
+    Vec3 center {
+      (rng.next() - 0.5f) * 19.0f,
+      (rng.next() - 0.5f) * 19.0f,
+      (rng.next() - 0.5f) * 19.0f,
+    };
+    scene.objects.push_back(Object { Sphere { &clutter, center, radius } });
+  }
 
-        float ss_x = 2.0 * float(x + dx) / float(target.width - 1) - 1.0;
-        float ss_y = 1.0 - 2.0 * float(y + dy) / float(target.height - 1);
+  settings.bvh.threads = settings.threadCount();
+  BvhStats bvh_stats = scene.build(settings.bvh);
+  if(settings.stats) {
+    fprintf(stderr,
+      "bvh: %.3f ms, %zu nodes, %zu leaves, depth %zu, sah cost %.2f, %.1f KiB\n",
+      1000.0 * bvh_stats.build_time,
+      bvh_stats.node_count,
+      bvh_stats.leaf_count,
+      bvh_stats.depth,
+      bvh_stats.sah_cost,
+      bvh_stats.memory / 1024.0
+    );
+  }
 
-        Vec3 ray_origin = camera.position;
-        Vec3 ray_direction = camera.projectRay(ss_x, ss_y);
+  // Everything besides seed and frame that changes the samples: the scene,
+  // the sampler and how paths are traced. Mixed with the splitmix64 finalizer.
+  // see: https://prng.di.unimi.it/splitmix64.c
+  uint64_t scene_key = 0;
+  auto addToKey = [&](uint64_t value)
+  {
+    uint64_t z = scene_key + value + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    scene_key = z ^ (z >> 31);
+  };
+  addToKey(settings.extra_spheres);
+  addToKey(uint64_t(settings.sampler));
+  addToKey(settings.trace.max_depth);
+  addToKey(PostProcess::bits(settings.trace.min_throughput));
+  addToKey(settings.trace.russian_roulette_depth);
+  Accumulator::CheckpointKey checkpoint_key { settings.seed, settings.frame, scene_key };
+  auto saveCheckpoint = [&](Accumulator const & accumulator)
+  {
+    if(settings.progressive.checkpoint != nullptr && !accumulator.saveCheckpoint(settings.progressive.checkpoint, checkpoint_key)) {
+      fprintf(stderr, "failed to write checkpoint %s\n", settings.progressive.checkpoint);
+    }
+  };
 
-        if(auto color = scene.trace(ray_origin, ray_direction))
-        {
-          final += *color;
-        }
-      }
-      target.set(x, y, final * (1.0 / float(super_sampling)));
+  PostProcess const post { settings.post };
+  size_t const band_rows = std::max<size_t>(1, settings.tile_size);
+  // out of core images are written one band after the other, so only one is in memory
+  size_t const stream_threads = (settings.framebuffer != nullptr) ? 1 : settings.threadCount();
+
+  ImageFormat const format = imageFormat(settings.output);
+  bool const hdr = isHdr(format);
+
+  // hdr formats get the linear rows, straight from the accumulated samples
+  auto saveLinear = [&](char const * file_name, Accumulator const & accumulator)
+  {
+    return saveHdr(file_name, format, settings.width, settings.height, [&](size_t begin, size_t end, Color * pixels) {
+      accumulator.resolveRows(begin, end, pixels);
+      accumulator.release(begin, end);
+    });
+  };
+
+  // viewers of shared memory see the accumulation buffers themselves
+  std::optional<SharedFrameBuffer> shared;
+
+  // progressive renders replace the output with a preview after every pass,
+  // written band by band so no copy of the whole image is needed, unless
+  // viewers get the image through shared memory
+  auto snapshot = [&](Accumulator const & accumulator)
+  {
+    saveCheckpoint(accumulator);
+    if(shared) {
+      shared->publish();
+      return;
+    }
+
+    std::string temp_file = std::string(settings.output) + ".tmp";
+    if(hdr) {
+      if(saveLinear(temp_file.c_str(), accumulator))
+        std::rename(temp_file.c_str(), settings.output);
+      return;
     }
+
+    ImageStream preview { temp_file.c_str(), format, settings.width, settings.height };
+    forEachBand(settings.height, band_rows, stream_threads, [&](size_t begin, size_t end) {
+      std::vector<Color> pixels((end - begin) * settings.width);
+      accumulator.resolveRows(begin, end, pixels.data());
+      std::vector<uint8_t> rgb = preview.buffer();
+      rgb.resize(3 * pixels.size());
+      post.apply(pixels.data(), rgb.data(), pixels.size());
+      preview.submit(begin, std::move(rgb));
+    });
+    if(preview.finish()) {
+      std::rename(temp_file.c_str(), settings.output);
+    }
+  };
+
+  Sampler sampler;
+  switch(settings.sampler) {
+    case SamplerType::uniform: sampler = UniformSampler { }; break;
+    case SamplerType::sobol: sampler = SobolSampler { settings.seed, settings.frame }; break;
+    case SamplerType::blue_noise: sampler = BlueNoiseSampler { settings.seed, settings.frame }; break;
   }
 
-  // apply basic color grading
-  // see: https://learnopengl.com/Advanced-Lighting/HDR
+  if(settings.denoise.benchmark) {
+    denoiseBenchmark(scene, camera, settings, sampler);
+    return 0;
+  }
+  if(settings.sequence.frames > 0) {
+    return renderSequence(scene, settings, sampler) ? 0 : 1;
+  }
 
-  // target.apply([](Color c) -> Color 
-  // {
-  //   // reinhard tone mapping
-  //   return c / (c + Color(1.0));
-  // });
+  Renderer renderer { scene, camera, settings, sampler };
+  if(settings.shared_memory != nullptr) {
+    // a time budget decides the sample count as it goes
+    uint64_t target_samples = (settings.progressive.time_budget > 0.0f) ? 0 : settings.super_sampling;
+    shared.emplace(settings.shared_memory, settings.width, settings.height, target_samples);
+    if(!shared->ok()) {
+      fprintf(stderr, "failed to create the shared memory object %s\n", settings.shared_memory);
+      return 1;
+    }
+  }
+  Accumulator accumulator = shared ? shared->accumulator() : Accumulator { settings.width, settings.height, settings.framebuffer };
+  if(!accumulator.ok()) {
+    fprintf(stderr, "failed to allocate the frame buffer\n");
+    return 1;
+  }
+  if(settings.denoise.iterations > 0 || settings.aov_output != nullptr)
+    accumulator.features.emplace(settings.width, settings.height);
+  if(settings.progressive.resume != nullptr) {
+    if(!accumulator.loadCheckpoint(settings.progressive.resume, checkpoint_key)) {
+      fprintf(stderr, "%s is not a checkpoint of this render\n", settings.progressive.resume);
+      return 1;
+    }
+  }
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+  if(settings.progressive.time_budget > 0.0f) {
+    deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(settings.progressive.time_budget));
+  }
 
-  float exposure = 1.00;
-  target.apply([exposure](Color c) -> Color 
+  // Without denoising, rows are final as soon as their last pass is done and
+  // are written while the rest of the image is still rendering. Linear
+  // output needs no conversion and is written afterwards in one go.
+  std::string const stream_file = std::string(settings.output) + ".part";
+  std::optional<ImageStream> stream;
+  if(settings.denoise.iterations == 0 && !hdr) {
+    stream.emplace(stream_file.c_str(), format, settings.width, settings.height);
+    if(!stream->ok) {
+      fprintf(stderr, "failed to write %s\n", stream_file.c_str());
+      return 1;
+    }
+  }
+  auto finished = [&](size_t begin, size_t end)
   {
-    // exposure tone mapping
-    return Color(1.0) - Color(exp(-c.r * exposure), exp(-c.g * exposure), exp(-c.b * exposure));
-  });
+    if(shared)
+      shared->publish();
+    if(!stream)
+      return;
+    std::vector<Color> pixels((end - begin) * settings.width);
+    accumulator.resolveRows(begin, end, pixels.data());
+    std::vector<uint8_t> rgb = stream->buffer();
+    rgb.resize(3 * pixels.size());
+    post.apply(pixels.data(), rgb.data(), pixels.size());
+    stream->submit(begin, std::move(rgb));
+  };
 
-  // apply gamma correction
-  float gamma = 2.2;
-  target.apply([gamma](Color c) -> Color 
-  { 
-    return Color {
-      powf(c.r, 1.0f / gamma),
-      powf(c.g, 1.0f / gamma),
-      powf(c.b, 1.0f / gamma),
-    };
+  RenderStats render_stats = renderer.render(accumulator, snapshot, finished, deadline);
+  if(shared)
+    shared->finish();
+  if(settings.stats) {
+    fprintf(stderr,
+      "render: %.3f s, %zu samples, %.2f spp\n",
+      render_stats.render_time,
+      render_stats.samples,
+      double(render_stats.samples) / double(settings.width * settings.height)
+    );
+  }
 
-  });
+  if(stream && (!stream->finish() || std::rename(stream_file.c_str(), settings.output) != 0)) {
+    fprintf(stderr, "failed to write %s\n", settings.output);
+    return 1;
+  }
+  if(hdr && settings.denoise.iterations == 0 && (!saveLinear(stream_file.c_str(), accumulator) || std::rename(stream_file.c_str(), settings.output) != 0)) {
+    fprintf(stderr, "failed to write %s\n", settings.output);
+    return 1;
+  }
+
+  saveCheckpoint(accumulator);
+
+  if(settings.denoise.iterations > 0 || settings.aov_output != nullptr)
+  {
+    Image target = accumulator.resolve();
+    FeatureBuffers const features = accumulator.features->resolve();
+    if(settings.aov_output != nullptr && !saveAovs(settings.aov_output, target, accumulator, features)) {
+      fprintf(stderr, "failed to write %s\n", settings.aov_output);
+      return 1;
+    }
+
+    if(settings.denoise.iterations > 0)
+    {
+      Denoiser { settings.denoise, settings.threadCount() }.apply(target, features, accumulator.variance());
+      bool saved;
+      if(hdr) {
+        saved = saveHdr(settings.output, format, settings.width, settings.height, [&](size_t begin, size_t end, Color * pixels) {
+          std::copy(target.pixels.begin() + begin * settings.width, target.pixels.begin() + end * settings.width, pixels);
+        });
+      } else {
+        ImageStream output { settings.output, format, settings.width, settings.height };
+        forEachBand(settings.height, band_rows, settings.threadCount(), [&](size_t begin, size_t end) {
+          std::vector<uint8_t> rgb = output.buffer();
+          rgb.resize(3 * (end - begin) * settings.width);
+          post.apply(target.pixels.data() + begin * settings.width, rgb.data(), (end - begin) * settings.width);
+          output.submit(begin, std::move(rgb));
+        });
+        saved = output.finish();
+      }
+      if(!saved) {
+        fprintf(stderr, "failed to write %s\n", settings.output);
+        return 1;
+      }
+    }
+  }
 
-  target.save("output.pgm");
+  if(deadline) {
+    fprintf(stderr,
+      "time budget: %.3f of %.3f s used, %zu passes, %.2f spp\n",
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+      settings.progressive.time_budget,
+      render_stats.passes,
+      double(render_stats.samples) / double(settings.width * settings.height)
+    );
+  }
   return 0;
 }
\ No newline at end of file